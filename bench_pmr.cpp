@@ -0,0 +1,62 @@
+#include <iostream>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "malloc_pmr.h"
+using namespace std;
+
+// build: g++ -std=c++17 -O2 bench_pmr.cpp malloc_4.cpp -o bench_pmr
+
+int N = 20000;
+int ROUNDS = 5;
+
+template <typename F>
+double timeMs(F f) {
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < ROUNDS; i++) f();
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / ROUNDS;
+}
+
+// many small vectors that grow and die
+template <typename Vector>
+void vectorWorkload(Vector make) {
+    for (int i = 0; i < N / 100; i++) {
+        auto v = make();
+        for (int j = 0; j < 100 + i % 50; j++) v.push_back(j);
+    }
+}
+
+// node based map: one allocation per insert, one free per erase
+template <typename Map>
+void mapWorkload(Map& m) {
+    for (int i = 0; i < N; i++) m[i] = i;
+    for (int i = 0; i < N; i += 2) m.erase(i);
+    for (int i = 0; i < N; i += 2) m[i] = -i;
+    m.clear();
+}
+
+int main() {
+    double std_vec = timeMs([] { vectorWorkload([] { return vector<int>(); }); });
+    double s_vec = timeMs([] { vectorWorkload([] { return vector<int, SmallocAllocator<int>>(); }); });
+    double pmr_vec = timeMs([] { vectorWorkload([] { return pmr::vector<int>(smalloc_resource()); }); });
+
+    double std_map = timeMs([] {
+        unordered_map<int, int> m;
+        mapWorkload(m);
+    });
+    double s_map = timeMs([] {
+        unordered_map<int, int, hash<int>, equal_to<int>, SmallocAllocator<pair<const int, int>>> m;
+        mapWorkload(m);
+    });
+    double pmr_map = timeMs([] {
+        pmr::unordered_map<int, int> m(smalloc_resource());
+        mapWorkload(m);
+    });
+
+    cout << "workload        std::allocator  SmallocAllocator  pmr(smalloc)  [ms]" << endl;
+    cout << "vector          " << std_vec << "\t" << s_vec << "\t" << pmr_vec << endl;
+    cout << "unordered_map   " << std_map << "\t" << s_map << "\t" << pmr_map << endl;
+
+    return 0;
+}
@@ -0,0 +1,89 @@
+#include <iostream>
+#include <chrono>
+#include <cstdlib>
+#include <unistd.h>
+#include "malloc_policy.h"
+using namespace std;
+
+// build: g++ -std=c++17 -O2 bench_policy.cpp -o bench_policy
+//
+// runs the same call sequences on every PolicyAllocator instantiation, one after
+// the other. the program break only grows, so the sbrk growth of a run is the
+// heap that instantiation needed
+
+int N = 200000;
+int SLOTS = 1024;
+
+struct Result {
+    double ms;
+    size_t heap_kb;
+    size_t free_blocks;
+    size_t free_bytes;
+};
+
+template <typename Heap, typename F>
+Result run(Heap& heap, F workload) {
+    char* start_break = (char*)sbrk(0);
+    auto start = chrono::steady_clock::now();
+    workload(heap);
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    return {ms, (size_t)((char*)sbrk(0) - start_break) / 1024, heap._num_free_blocks(), heap._num_free_bytes()};
+}
+
+// random sizes (mostly small, some past the mmap threshold), random lifetimes
+template <typename Heap>
+void churnWorkload(Heap& heap) {
+    void** slots = (void**)calloc(SLOTS, sizeof(void*));
+    srand(1);
+    for (int i = 0; i < N; i++) {
+        int k = rand() % SLOTS;
+        size_t size = rand() % 64 == 0 ? 100000 + rand() % 200000 : 16 + rand() % 1000;
+        heap.sfree(slots[k]);
+        slots[k] = heap.smalloc(size);
+    }
+    for (int k = 0; k < SLOTS; k++) heap.sfree(slots[k]);
+    free(slots);
+}
+
+// buffers that keep growing by srealloc, like a vector
+template <typename Heap>
+void growWorkload(Heap& heap) {
+    void** slots = (void**)calloc(SLOTS, sizeof(void*));
+    size_t* sizes = (size_t*)calloc(SLOTS, sizeof(size_t));
+    srand(2);
+    for (int i = 0; i < N / 4; i++) {
+        int k = rand() % SLOTS;
+        if (sizes[k] > 64 * 1024) {
+            heap.sfree(slots[k]);
+            slots[k] = nullptr;
+            sizes[k] = 0;
+        }
+        sizes[k] = sizes[k] * 2 + 32;
+        void* grown = heap.srealloc(slots[k], sizes[k]);
+        if (grown) slots[k] = grown;
+    }
+    for (int k = 0; k < SLOTS; k++) heap.sfree(slots[k]);
+    free(sizes);
+    free(slots);
+}
+
+template <typename Heap>
+void report(const char* name) {
+    // static: the instances own their blocks for the whole process
+    static Heap churn_heap, grow_heap;
+    Result churn = run(churn_heap, churnWorkload<Heap>);
+    Result grow = run(grow_heap, growWorkload<Heap>);
+    cout << name << "\t" << churn.ms << "\t" << churn.heap_kb << "\t" << churn.free_blocks << "/" << churn.free_bytes
+         << "\t\t" << grow.ms << "\t" << grow.heap_kb << "\t" << grow.free_blocks << "/" << grow.free_bytes << endl;
+}
+
+int main() {
+    cout << "policy\t\tchurn [ms]\theap [KB]\tfree blocks/bytes\tgrow [ms]\theap [KB]\tfree blocks/bytes" << endl;
+    report<Malloc2Allocator>("malloc_2\t");
+    report<Malloc3Allocator>("malloc_3\t");
+    report<BestFitAllocator>("best fit\t");
+    report<CompactAllocator>("compact\t\t");
+    report<BumpAllocator>("bump\t\t");
+
+    return 0;
+}
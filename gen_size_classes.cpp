@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+// build: g++ -std=c++17 -O2 gen_size_classes.cpp -o gen_size_classes
+//
+// reads the sizes a service allocates and writes size_classes.h, compiled in by
+// malloc_4.cpp and malloc_4_mt.cpp:
+//   ./gen_size_classes [-n max_classes] [-w waste_percent] [-s split_percentile] [input] > size_classes.h
+// every input line is "size" (a trace) or "size count" (a histogram), '#' starts a comment
+
+/*---------------DECLARATIONS-----------------------------------*/
+#define SMALL_MAX 1024      // like malloc_4_mt.cpp: larger sizes get their own span
+#define GRANULE 16          // classes are multiples of 16
+#define NUM_GRANULES (SMALL_MAX / GRANULE)
+#define DEFAULT_MAX_CLASSES 20
+#define DEFAULT_WASTE 1     // % of the requested bytes a table may waste over the best one of max_classes
+#define DEFAULT_SPLIT 25    // a remainder smaller than 25% of the requests is not split off
+#define MAX_SPLIT 4096      // over this, big free blocks hold on to too many unused bytes
+
+struct Histogram {
+    double count[NUM_GRANULES + 1]; // requests that round up to granule i
+    double bytes[NUM_GRANULES + 1]; // their requested bytes
+    double total_count;
+    double total_bytes;
+    double large_count;             // requests over SMALL_MAX, no class serves them
+    std::vector<std::pair<size_t, double>> sizes;
+};
+
+struct Table {
+    std::vector<size_t> classes;
+    double waste;
+};
+
+/*---------------HELPERS----------------------------------------*/
+bool readHistogram(FILE* in, Histogram& histogram) {
+    char line[256];
+    while (fgets(line, sizeof(line), in)) {
+        char* comment = strchr(line, '#');
+        if (comment) *comment = '\0';
+
+        unsigned long long size;
+        double count = 1;
+        int fields = sscanf(line, "%llu %lf", &size, &count);
+        if (fields <= 0) continue;
+        if (size == 0 || count <= 0) continue;
+
+        histogram.sizes.emplace_back(size, count);
+        if (size > SMALL_MAX) {
+            histogram.large_count += count;
+            continue;
+        }
+
+        size_t granule = (size + GRANULE - 1) / GRANULE;
+        histogram.count[granule] += count;
+        histogram.bytes[granule] += count * size;
+        histogram.total_count += count;
+        histogram.total_bytes += count * size;
+    }
+    return !ferror(in);
+}
+
+/**
+ * @return the bytes lost to rounding requests of granules (first, last] up to class last
+ */
+double classWaste(const Histogram& histogram, size_t first, size_t last) {
+    double waste = 0;
+    for (size_t granule = first + 1; granule <= last; granule++) {
+        waste += histogram.count[granule] * last * GRANULE - histogram.bytes[granule];
+    }
+    return waste;
+}
+
+/**
+ * computes, for every number of classes up to max_classes, the table with the least waste.
+ * the last class is always SMALL_MAX
+ */
+std::vector<Table> bestTables(const Histogram& histogram, size_t max_classes) {
+    const double NONE = -1;
+    // best[k][g]: least waste of k classes covering granules 1..g, the last one being g
+    std::vector<std::vector<double>> best(max_classes + 1, std::vector<double>(NUM_GRANULES + 1, NONE));
+    std::vector<std::vector<size_t>> from(max_classes + 1, std::vector<size_t>(NUM_GRANULES + 1, 0));
+
+    best[0][0] = 0;
+    for (size_t k = 1; k <= max_classes; k++) {
+        for (size_t last = 1; last <= NUM_GRANULES; last++) {
+            for (size_t first = 0; first < last; first++) {
+                if (best[k - 1][first] == NONE) continue;
+
+                double waste = best[k - 1][first] + classWaste(histogram, first, last);
+                if (best[k][last] == NONE || waste < best[k][last]) {
+                    best[k][last] = waste;
+                    from[k][last] = first;
+                }
+            }
+        }
+    }
+
+    std::vector<Table> tables(max_classes + 1);
+    for (size_t k = 1; k <= max_classes; k++) {
+        if (best[k][NUM_GRANULES] == NONE) continue;
+
+        tables[k].waste = best[k][NUM_GRANULES];
+        size_t last = NUM_GRANULES;
+        for (size_t i = k; i > 0; i--) {
+            tables[k].classes.insert(tables[k].classes.begin(), last * GRANULE);
+            last = from[i][last];
+        }
+    }
+    return tables;
+}
+
+/**
+ * @return the size under which percentile % of the requests fall, rounded up to GRANULE
+ */
+size_t splitSize(Histogram& histogram, double percentile) {
+    double total = histogram.total_count + histogram.large_count;
+    std::sort(histogram.sizes.begin(), histogram.sizes.end());
+
+    double seen = 0;
+    size_t size = GRANULE;
+    for (auto& entry : histogram.sizes) {
+        size = entry.first;
+        seen += entry.second;
+        if (seen * 100 >= total * percentile) break;
+    }
+
+    size = (size + GRANULE - 1) / GRANULE * GRANULE;
+    return size > MAX_SPLIT ? MAX_SPLIT : size;
+}
+
+void writeHeader(FILE* out, const char* input, const Histogram& histogram, const Table& table, size_t split) {
+    fprintf(out, "// generated by gen_size_classes from %s, do not edit\n", input);
+    fprintf(out, "// %.0f requests up to %d bytes, %.2f%% of their bytes lost to rounding\n",
+            histogram.total_count, SMALL_MAX, histogram.total_bytes ? 100 * table.waste / histogram.total_bytes : 0);
+    fprintf(out, "#ifndef OS4_SIZE_CLASSES_H\n");
+    fprintf(out, "#define OS4_SIZE_CLASSES_H\n\n");
+    fprintf(out, "#include <stddef.h>\n\n");
+
+    fprintf(out, "#define NUM_CLASSES %zu\n", table.classes.size());
+    fprintf(out, "#define SPLIT_THRESHOLD %zu // smallest remainder a free block is split into\n\n", split);
+
+    fprintf(out, "// object sizes of the small classes, multiples of 16\n");
+    fprintf(out, "constexpr size_t size_classes[NUM_CLASSES] = {");
+    for (size_t i = 0; i < table.classes.size(); i++) {
+        fprintf(out, "%s%zu", i % 10 ? ", " : (i ? ",\n    " : "\n    "), table.classes[i]);
+    }
+    fprintf(out, "\n};\n\n");
+    fprintf(out, "#endif //OS4_SIZE_CLASSES_H\n");
+}
+
+void usage() {
+    fprintf(stderr, "usage: gen_size_classes [-n max_classes] [-w waste_percent] [-s split_percentile] [input]\n");
+}
+
+/*---------------MAIN-------------------------------------------*/
+int main(int argc, char** argv) {
+    size_t max_classes = DEFAULT_MAX_CLASSES;
+    double waste_percent = DEFAULT_WASTE;
+    double split_percentile = DEFAULT_SPLIT;
+    const char* input = nullptr;
+
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 < argc && !strcmp(argv[i], "-n")) max_classes = strtoul(argv[++i], nullptr, 10);
+        else if (i + 1 < argc && !strcmp(argv[i], "-w")) waste_percent = strtod(argv[++i], nullptr);
+        else if (i + 1 < argc && !strcmp(argv[i], "-s")) split_percentile = strtod(argv[++i], nullptr);
+        else if (!input && argv[i][0] != '-') input = argv[i];
+        else {
+            usage();
+            return 1;
+        }
+    }
+    if (max_classes == 0 || max_classes > NUM_GRANULES) {
+        fprintf(stderr, "max_classes must be 1 to %d\n", NUM_GRANULES);
+        return 1;
+    }
+
+    FILE* in = input ? fopen(input, "r") : stdin;
+    if (!in) {
+        perror(input);
+        return 1;
+    }
+    Histogram histogram = {};
+    bool read = readHistogram(in, histogram);
+    if (input) fclose(in);
+    if (!read || histogram.total_count + histogram.large_count == 0) {
+        fprintf(stderr, "no sizes read\n");
+        return 1;
+    }
+
+    // the fewest classes within the waste budget (less classes: less cached memory per thread).
+    // rounding to GRANULE wastes some bytes with any number of classes, only the rest counts
+    std::vector<Table> tables = bestTables(histogram, max_classes);
+    size_t chosen = max_classes;
+    for (size_t k = 1; k <= max_classes; k++) {
+        if ((tables[k].waste - tables[max_classes].waste) * 100 <= waste_percent * histogram.total_bytes) {
+            chosen = k;
+            break;
+        }
+    }
+
+    for (size_t k = 1; k <= max_classes; k++) {
+        fprintf(stderr, "%s%3zu classes: %6.2f%% waste\n", k == chosen ? "> " : "  ", k,
+                histogram.total_bytes ? 100 * tables[k].waste / histogram.total_bytes : 0);
+    }
+
+    writeHeader(stdout, input ? input : "stdin", histogram, tables[chosen], splitSize(histogram, split_percentile));
+    return 0;
+}
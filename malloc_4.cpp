@@ -2,13 +2,44 @@
 #include <string.h>
 #include <sys/mman.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <atomic>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include "malloc_4.h"
+#include "size_classes.h" // SPLIT_THRESHOLD (gen_size_classes.cpp)
 
 /*---------------DECLARATIONS-----------------------------------*/
 #define MAX_ALLOC 100000000
 #define MMAP_THRESHOLD 131072 // = 128*1024
-
-void* smalloc(size_t size);
-void sfree(void* p);
+#define ARENA_CHUNK_SIZE 65536 // = 64*1024
+#define SEGMENT_SIZE 1048576 // = 1024*1024, what a lifetime sub-heap maps at once
+#define NUM_SUB_HEAPS 2 // SLIFETIME_SHORT, SLIFETIME_LONG
+#define HANDLES_PER_CHUNK 64
+#define MMAP_THRESHOLD_MAX 33554432 // = 32*1024*1024, default upper bound of the adaptive threshold
+#define THRESHOLD_HISTORY 32
+#define FRAGMENTATION_LIMIT 2 // free bytes over 1/2 of the heap lower the adaptive threshold
+#define INDEX_MIN_ENTRIES 512
+#define WALK_MMAP (NUM_SUB_HEAPS + 1) // the part of a heap walk after the sbrk heap and the sub-heaps
+#define MAP_BUFFER_RECORDS 256
+#define HUGE_PAGE_SIZE 2097152 // = 2*1024*1024, a transparent huge page on x86_64
+#define PROFILE_BUCKETS 128
+#define PROFILE_MAGIC 0x31454c49464f5250 // "PROFILE1"
+#define PROFILE_MAX_BLOCKS 4096 // blocks sprofile_save walks per heap lock hold
+#define MAX_RECLAIM_CALLBACKS 16
+#define RECLAIM_MAX_BLOCKS 64 // free blocks purged per heap lock hold by a reclaim
+#define DEFERRED_BATCH 64 // deferred blocks freed per heap lock hold
+#define DRAINER_PERIOD_MS 10
+#define DRAINER_WAKE_BLOCKS 256 // wakes the drainer before its period is up
+
+void* allocBlock(size_t size);
+void* allocHinted(size_t size, size_t heap);
+void freeBlock(void* p);
+void reclaimBudget();
+size_t drainDeferred(size_t max_blocks);
 size_t _size_meta_data();
 
 size_t free_blocks = 0, free_bytes = 0, allocated_blocks = 0, allocated_bytes = 0;
@@ -17,6 +48,10 @@ struct MallocMetadata {
     size_t size;
     bool is_free;
     bool is_mmap;
+    unsigned char heap; // SLifetime of the heap the block belongs to
+    bool is_movable;    // a handle's block, its payload starts with the SHandleEntry*
+    bool is_reserved;   // an sreserve buffer, its range goes on after size
+    STag tag;           // charged with the block while it's allocated
 
     MallocMetadata* next_free; // if not free then null
     MallocMetadata* prev_free; // sorted by size
@@ -26,11 +61,152 @@ struct MallocMetadata {
 };
 
 // sorted list by size
-MallocMetadata dummy_free = {0, false, false, nullptr, nullptr, nullptr, nullptr};
+MallocMetadata dummy_free = {0, false, false, SLIFETIME_DEFAULT, false, false, STAG_NONE, nullptr, nullptr, nullptr, nullptr};
 
 MallocMetadata* heap_head = nullptr;
 MallocMetadata* wilderness = nullptr;
 
+// mmap'ed blocks, linked through heap_next / heap_prev and sorted by address
+MallocMetadata* mmap_head = nullptr;
+size_t mmap_changes = 0;    // blocks unmapped, lets a heap walk resume between lock holds
+
+// a region mapped by a sub-heap, its blocks follow this header and have a heap list of their own
+struct Segment {
+    Segment* next;
+    Segment* prev;
+};
+
+// blocks of one lifetime hint, kept away from the sbrk heap and from each other
+struct SubHeap {
+    MallocMetadata dummy_free;  // like the global one
+    Segment* segments;
+    size_t num_segments;
+};
+
+SubHeap sub_heaps[NUM_SUB_HEAPS];
+
+// the blocks of a free list as dense arrays, sorted by address like the list:
+// a fit search streams through sizes instead of chasing next_free
+struct FreeIndex {
+    size_t* sizes;
+    MallocMetadata** blocks;
+    size_t count;
+    size_t capacity;
+    bool broken;    // it couldn't grow, the list is walked instead from then on
+};
+
+FreeIndex free_index[1 + NUM_SUB_HEAPS]; // by SLifetime
+
+// the first index of sizes[0..count) that is >= size, count if none
+size_t (*scan_sizes)(const size_t* sizes, size_t count, size_t size) = nullptr;
+
+// guards every block and global above, taken by the public functions
+pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// this thread took the heap past the soft limit, it reclaims once it releases the lock
+thread_local bool over_soft_limit = false;
+
+struct HeapGuard {
+    HeapGuard() { pthread_mutex_lock(&heap_lock); }
+    ~HeapGuard() {
+        pthread_mutex_unlock(&heap_lock);
+        if (over_soft_limit) reclaimBudget();
+    }
+};
+
+// written at the start of a free block's payload (when it fits) by markFreed
+struct FreeStamp {
+    size_t freed_at;    // purge_clock when the block became free
+    size_t purged;      // its interior pages were given back to the OS
+};
+
+size_t purge_clock = 0;         // advanced once per spurge pass
+size_t free_list_changes = 0;   // lets spurge resume a walk between lock holds
+SPurgeStats purge_stats = {0, 0, 0, 0};
+
+// how reallocBlock grows a block, cheapest first (see chooseRealloc)
+enum ReallocStrategy {
+    REALLOC_IN_PLACE,               // it already fits
+    REALLOC_MERGE_NEXT,
+    REALLOC_EXTEND_WILDERNESS,
+    REALLOC_MERGE_NEXT_WILDERNESS,
+    REALLOC_MERGE_PREV,
+    REALLOC_MERGE_BOTH,
+    REALLOC_RELOCATE,
+    NUM_REALLOC_STRATEGIES
+};
+
+size_t realloc_counts[NUM_REALLOC_STRATEGIES] = {};
+size_t realloc_copied_bytes = 0;
+
+// blocks of at least this size are mmap'ed, see smmap_threshold_adapt
+size_t mmap_threshold = MMAP_THRESHOLD;
+bool threshold_adaptive = false;
+SMmapThresholdConfig threshold_bounds = {MMAP_THRESHOLD, MMAP_THRESHOLD_MAX};
+SThresholdChange threshold_history[THRESHOLD_HISTORY]; // a ring, the oldest is overwritten
+size_t threshold_changes = 0;
+
+struct ReclaimCallback {
+    SReclaimCallback callback;
+    void* context;
+};
+
+SMemoryBudget memory_budget = {0, 0};
+ReclaimCallback reclaim_callbacks[MAX_RECLAIM_CALLBACKS];
+size_t num_reclaim_callbacks = 0;
+bool (*cache_flush)() = nullptr;
+bool reclaiming = false;    // one thread reclaims at a time
+bool reclaim_requested = false;
+size_t reclaim_mark = 0;    // above the soft limit, the footprint that triggers the next reclaim
+SBudgetStats budget_stats = {0, 0, 0, 0};
+
+thread_local STag current_tag = STAG_NONE;
+STagStats tag_stats[STAG_MAX] = {}; // heap_lock held
+
+// written over the payload of a block sfree_deferred queued
+struct DeferredFree {
+    DeferredFree* next;
+};
+
+// a Treiber stack, taken as a whole by a drain (so there is no ABA to guard against)
+std::atomic<DeferredFree*> deferred_head(nullptr);
+std::atomic<size_t> deferred_blocks(0);
+std::atomic<size_t> deferred_bytes(0);
+std::atomic<size_t> drained_blocks(0);
+
+pthread_t drainer_thread;
+bool drainer_running = false;   // guarded by drainer_lock, like the rest
+bool drainer_stopping = false;
+size_t drainer_period_ms = DRAINER_PERIOD_MS;
+pthread_mutex_t drainer_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t drainer_wakeup = PTHREAD_COND_INITIALIZER;
+
+// what a SHandle points to, never moves
+struct SHandleEntry {
+    void* ptr;              // the user bytes, after the back pointer
+    size_t locks;           // the block moves only while 0
+    SHandleEntry* next_free;
+};
+
+SHandleEntry* free_handles = nullptr;
+MallocMetadata* compact_cursor = nullptr;   // where the last scompact stopped
+size_t compact_changes = 0;                 // free_list_changes when it stopped
+SCompactStats compact_stats = {0, 0, 0, 0};
+
+// a region of memory owned by an arena, allocated with smalloc
+struct ArenaChunk {
+    ArenaChunk* next;
+    size_t size;        // usable bytes after this header
+};
+
+struct SArena {
+    size_t chunk_size;
+    ArenaChunk* first;      // chunks in list order, kept across resets
+    ArenaChunk* current;    // the chunk we bump in
+    char* bump;             // next free byte in current
+    char* end;              // end of current
+};
+
 /*---------------HELPER FUNCTIONS---------------------------*/
 
 size_t align(size_t size) {
@@ -38,8 +214,140 @@ size_t align(size_t size) {
     return ((size / 8) + 1) * 8;
 }
 
+char* pageFloor(void* addr) {
+    size_t page_size = getpagesize();
+    return (char*)((size_t)addr & ~(page_size - 1));
+}
+
+char* pageCeil(void* addr) {
+    return pageFloor((char*)addr + getpagesize() - 1);
+}
+
+/**
+ * someone else (libc's malloc) may sbrk between our blocks,
+ * so heap neighbours are merged only if they really touch
+ */
+bool isAdjacent(MallocMetadata* block, MallocMetadata* next) {
+    return (char*)block + _size_meta_data() + block->size == (char*)next;
+}
+
+bool atProgramBreak(MallocMetadata* block) {
+    return (char*)block + _size_meta_data() + block->size == (char*)sbrk(0);
+}
+
+/**
+ * @return the dummy head of the free list the block belongs to
+ */
+MallocMetadata* freeListOf(size_t heap) {
+    if (heap == SLIFETIME_DEFAULT) return &dummy_free;
+    return &sub_heaps[heap - 1].dummy_free;
+}
+
+size_t scanSizesScalar(const size_t* sizes, size_t count, size_t size) {
+    for (size_t i = 0; i < count; i++) {
+        if (sizes[i] >= size) return i;
+    }
+    return count;
+}
+
+#if defined(__x86_64__)
+// block sizes are far below 2^63, so signed 64 bit compares work: sizes[i] > size - 1
+__attribute__((target("avx2")))
+size_t scanSizesAvx2(const size_t* sizes, size_t count, size_t size) {
+    __m256i wanted = _mm256_set1_epi64x((long long)size - 1);
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i low = _mm256_cmpgt_epi64(_mm256_loadu_si256((const __m256i*)(sizes + i)), wanted);
+        __m256i high = _mm256_cmpgt_epi64(_mm256_loadu_si256((const __m256i*)(sizes + i + 4)), wanted);
+
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(low)) | (_mm256_movemask_pd(_mm256_castsi256_pd(high)) << 4);
+        if (mask) return i + __builtin_ctz(mask);
+    }
+
+    return i + scanSizesScalar(sizes + i, count - i, size);
+}
+
+__attribute__((target("sse4.2")))
+size_t scanSizesSse42(const size_t* sizes, size_t count, size_t size) {
+    __m128i wanted = _mm_set1_epi64x((long long)size - 1);
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i low = _mm_cmpgt_epi64(_mm_loadu_si128((const __m128i*)(sizes + i)), wanted);
+        __m128i high = _mm_cmpgt_epi64(_mm_loadu_si128((const __m128i*)(sizes + i + 2)), wanted);
+
+        int mask = _mm_movemask_pd(_mm_castsi128_pd(low)) | (_mm_movemask_pd(_mm_castsi128_pd(high)) << 2);
+        if (mask) return i + __builtin_ctz(mask);
+    }
+
+    return i + scanSizesScalar(sizes + i, count - i, size);
+}
+#endif
+
+/**
+ * @return the first free block of heap whose size is at least size, or nullptr
+ */
+MallocMetadata* firstFit(size_t heap, size_t size) {
+    FreeIndex& index = free_index[heap];
+
+    if (index.broken) {
+        MallocMetadata* block = freeListOf(heap)->next_free;
+        while (block && block->size < size) block = block->next_free;
+        return block;
+    }
+
+    if (!scan_sizes) {
+        scan_sizes = scanSizesScalar;
+#if defined(__x86_64__)
+        if (__builtin_cpu_supports("sse4.2")) scan_sizes = scanSizesSse42;
+        if (__builtin_cpu_supports("avx2")) scan_sizes = scanSizesAvx2;
+#endif
+    }
+
+    size_t i = scan_sizes(index.sizes, index.count, size);
+    return i < index.count ? index.blocks[i] : nullptr;
+}
+
+/**
+ * doubles both arrays (mmap'ed, the heap can't allocate for itself while its lists change)
+ */
+bool growIndex(FreeIndex& index) {
+    size_t capacity = index.capacity ? index.capacity * 2 : INDEX_MIN_ENTRIES;
+    size_t old_bytes = index.capacity * sizeof(size_t);
+    size_t new_bytes = capacity * sizeof(size_t);
+
+    void* sizes = index.capacity
+            ? mremap(index.sizes, old_bytes, new_bytes, MREMAP_MAYMOVE)
+            : mmap(NULL, new_bytes, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (sizes == MAP_FAILED) return false;
+    index.sizes = (size_t*)sizes;
+
+    void* blocks = index.capacity
+            ? mremap(index.blocks, old_bytes, new_bytes, MREMAP_MAYMOVE)
+            : mmap(NULL, new_bytes, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (blocks == MAP_FAILED) return false; // sizes may be larger than needed, that's fine
+    index.blocks = (MallocMetadata**)blocks;
+
+    index.capacity = capacity;
+    return true;
+}
+
+/**
+ * @return the position of block in the index (or where it belongs), by binary search
+ */
+size_t indexPosition(FreeIndex& index, MallocMetadata* block) {
+    size_t low = 0, high = index.count;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (index.blocks[mid] < block) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
 bool LARGE_ENOUGH(MallocMetadata* block, size_t size) {
-    return (block->size >= _size_meta_data() + size + 128);
+    return (block->size >= _size_meta_data() + size + SPLIT_THRESHOLD);
 }
 
 /**
@@ -51,11 +359,33 @@ void addToFreeList(MallocMetadata* block) {
     // update used free_blocks, free_bytes
     free_blocks++;
     free_bytes += block->size;
+    free_list_changes++;
 
     block->is_free = true;
 
+    FreeIndex& index = free_index[block->heap];
+    if (!index.broken && (index.count < index.capacity || growIndex(index))) {
+        size_t pos = indexPosition(index, block);
+        size_t after = index.count - pos;
+        memmove(index.sizes + pos + 1, index.sizes + pos, after * sizeof(size_t));
+        memmove(index.blocks + pos + 1, index.blocks + pos, after * sizeof(MallocMetadata*));
+        index.sizes[pos] = block->size;
+        index.blocks[pos] = block;
+        index.count++;
+
+        // the previous block of the index is the previous one of the list
+        MallocMetadata* prev = pos > 0 ? index.blocks[pos - 1] : freeListOf(block->heap);
+        block->prev_free = prev;
+        block->next_free = prev->next_free;
+        if (prev->next_free) prev->next_free->prev_free = block;
+        prev->next_free = block;
+
+        return;
+    }
+    index.broken = true;
+
     // traverse from dummy
-    MallocMetadata* iter = &dummy_free;
+    MallocMetadata* iter = freeListOf(block->heap);
     while (iter->next_free) {
         if (iter->next_free > block) { // find proper place
             // add
@@ -82,6 +412,17 @@ void addToFreeList(MallocMetadata* block) {
 void removeFromFreeList(MallocMetadata* block) {
     assert(block);
 
+    FreeIndex& index = free_index[block->heap];
+    if (!index.broken) {
+        size_t pos = indexPosition(index, block);
+        assert(pos < index.count && index.blocks[pos] == block);
+
+        size_t after = index.count - pos - 1;
+        memmove(index.sizes + pos, index.sizes + pos + 1, after * sizeof(size_t));
+        memmove(index.blocks + pos, index.blocks + pos + 1, after * sizeof(MallocMetadata*));
+        index.count--;
+    }
+
     if (block->prev_free) block->prev_free->next_free = block->next_free;
     if (block->next_free) block->next_free->prev_free = block->prev_free;
     block->prev_free = nullptr;
@@ -92,6 +433,18 @@ void removeFromFreeList(MallocMetadata* block) {
     // update used free_blocks, free_bytes
     free_blocks--;
     free_bytes -= block->size;
+    free_list_changes++;
+}
+
+/**
+ * @param block - a block that just became free (not a block passing through the free list)
+ */
+void markFreed(MallocMetadata* block) {
+    if (block->size < sizeof(FreeStamp)) return; // too small to ever be purged
+
+    auto stamp = (FreeStamp*)((char*)block + _size_meta_data());
+    stamp->freed_at = purge_clock;
+    stamp->purged = 0;
 }
 
 /**
@@ -103,9 +456,13 @@ void cutBlocks(MallocMetadata* block, size_t wanted_size) {
     new_block->size = block->size - wanted_size - _size_meta_data();
     new_block->is_free = true; // new block is free
     new_block->is_mmap = false; // new block not mmap'ed
+    new_block->heap = block->heap;
+    new_block->is_movable = false;
+    new_block->is_reserved = false;
 
     // add the new block to free list
     addToFreeList(new_block);
+    markFreed(new_block);
 
     // update old block size
     removeFromFreeList(block);
@@ -120,6 +477,7 @@ void cutBlocks(MallocMetadata* block, size_t wanted_size) {
     // update heap list
     new_block->heap_next = block->heap_next;
     new_block->heap_prev = block;
+    if (block->heap_next) block->heap_next->heap_prev = new_block;
     block->heap_next = new_block;
 
     // update wilderness if necessary
@@ -129,20 +487,21 @@ void cutBlocks(MallocMetadata* block, size_t wanted_size) {
 
 /**
  * @param block - a free block to merge with adjacent free blocks
+ * @return the free block that contains block after merging
  */
-void combineBlocks(MallocMetadata* block) {
+MallocMetadata* combineBlocks(MallocMetadata* block) {
     auto prev = block->heap_prev;
     auto next = block->heap_next;
 
-    if (!prev && !next) return;  // no combinations to do
+    if (!prev && !next) return block;  // no combinations to do
 
     bool free_prev = false;
-    if (prev) free_prev = prev->is_free;
+    if (prev) free_prev = prev->is_free && isAdjacent(prev, block);
 
     bool free_next = false;
-    if (next) free_next = next->is_free;
+    if (next) free_next = next->is_free && isAdjacent(block, next);
 
-    if (!free_prev && !free_next) return; // no combinations to do
+    if (!free_prev && !free_next) return block; // no combinations to do
 
     // actions to be taken in any combination option:
     removeFromFreeList(block); // remove the current block from the free list
@@ -208,18 +567,25 @@ void combineBlocks(MallocMetadata* block) {
     new_block->size = new_size; // update new_block's size
     addToFreeList(new_block);   // insert new block into the free list
                                 // (+ update global variables)
+    return new_block;
 }
 
 void* reallocate(void* oldp, size_t old_size, size_t new_size) {
-    void* newp = smalloc(new_size);
+    // stay in the same heap
+    auto block = (MallocMetadata*)((char*)oldp - _size_meta_data());
+    void* newp = block->is_mmap ? allocBlock(new_size) : allocHinted(new_size, block->heap);
     if (newp == nullptr) return nullptr;    // smalloc failed
 
     // copy old data to new block using memmove
     size_t min_size = old_size < new_size ? old_size : new_size;
     memmove(newp, oldp, min_size);
 
-    // free old data using sfree (only if you succeed until now)
-    sfree(oldp);
+    // free old data using freeBlock (only if you succeed until now)
+    freeBlock(oldp);
+
+    // counted once it worked, a failed srealloc leaves the stats as they were
+    realloc_counts[REALLOC_RELOCATE]++;
+    realloc_copied_bytes += min_size;
 
     return newp;
 }
@@ -242,115 +608,113 @@ void* enlargeWilderness(size_t size) {
 }
 
 /**
- * @param block - an allocated block to merge with adjacent free blocks
- *                (used for realloc)
+ * @param block - an allocated block, absorbs its free next neighbour (no copy)
  */
-MallocMetadata* tryMergingNeighbor(MallocMetadata* block, size_t wanted_size) {
-    auto prev = block->heap_prev;
-    auto next = block->heap_next;
+void mergeNext(MallocMetadata* block) {
+    MallocMetadata* next = block->heap_next;
+    removeFromFreeList(next);
 
-    if (!prev && !next) return nullptr;  // no combinations to do
+    // update new block's size
+    block->size += _size_meta_data() + next->size;
 
-    bool free_prev = false;
-    if (prev) free_prev = prev->is_free;
-
-    bool free_next = false;
-    if (next) free_next = next->is_free;
-
-    if (!free_prev && !free_next) return nullptr; // merging is not an option
+    // update heap pointers
+    block->heap_next = next->heap_next;
+    if (next->heap_next) next->heap_next->heap_prev = block;
 
-    size_t block_size = block->size + _size_meta_data();
-
-    // Try merging with previous neighbour
-    if (free_prev && prev->size + block_size >= wanted_size) {
-
-        // remove the free neighbor from free list
-        removeFromFreeList(prev);
-        prev->is_free = false;
+    allocated_blocks--;
+    allocated_bytes += _size_meta_data();
 
-        // copy the data to the start of the new block
-        void* copy_from = (char*)block + _size_meta_data();
-        void* copy_to = (char*)prev + _size_meta_data();
-        memmove(copy_to, copy_from, block->size);
+    // update wilderness if necessary
+    if (next == wilderness) wilderness = block;
+}
 
-        // update new block's size
-        prev->size += _size_meta_data() + block->size;
+/**
+ * @param block - an allocated block, moved down into its free previous neighbour
+ * @return the merged block (not in the free list)
+ */
+MallocMetadata* mergePrev(MallocMetadata* block) {
+    MallocMetadata* prev = block->heap_prev;
+    removeFromFreeList(prev);
 
-        // update heap pointers
-        prev->heap_next = next;
-        if (next) next->heap_prev = prev;
+    // the copy may overwrite block's header, read it first
+    size_t size = block->size;
+    MallocMetadata* next = block->heap_next;
+    bool was_wilderness = block == wilderness;
 
-        // update global variables
-        allocated_blocks--;
-        allocated_bytes += _size_meta_data();
+    // copy the data to the start of the new block
+    memmove((char*)prev + _size_meta_data(), (char*)block + _size_meta_data(), size);
 
-        // update wilderness if necessary
-        if (block == wilderness) {
-            wilderness = prev;
-        }
+    // update new block's size
+    prev->size += _size_meta_data() + size;
 
-        return prev;    // return for allocation (not added to free list)
-    }
+    // update heap pointers
+    prev->heap_next = next;
+    if (next) next->heap_prev = prev;
 
-    // Try merging with next neighbour
-    if (free_next && next->size + block_size >= wanted_size) {
-        // remove the free neighbor from free list
-        removeFromFreeList(next);
-        next->is_free = false;
+    allocated_blocks--;
+    allocated_bytes += _size_meta_data();
 
-        // no need to copy the data
+    // update wilderness if necessary
+    if (was_wilderness) wilderness = prev;
 
-        // update new block's size
-        block->size += _size_meta_data() + next->size;
+    return prev;
+}
 
-        // update heap pointers
-        block->heap_next = next->heap_next;
-        if (next->heap_next) next->heap_next->heap_prev = block;
+// what growing a block costs: bytes memmoved first, then bytes the heap grows by
+struct ReallocCost {
+    size_t copied;
+    size_t growth;
+};
 
-        allocated_blocks--;
-        allocated_bytes += _size_meta_data();
+bool cheaper(ReallocCost a, ReallocCost b) {
+    return a.copied < b.copied || (a.copied == b.copied && a.growth < b.growth);
+}
 
-        // update wilderness if necessary
-        if (next == wilderness) {
-            wilderness = block;
-        }
+/**
+ * @param block - an allocated heap block smaller than size
+ * @return the cheapest way to grow it, ties go to the earlier strategy
+ */
+ReallocStrategy chooseRealloc(MallocMetadata* block, size_t size) {
+    MallocMetadata* prev = block->heap_prev;
+    MallocMetadata* next = block->heap_next;
+    bool free_prev = prev && prev->is_free && isAdjacent(prev, block);
+    bool free_next = next && next->is_free && isAdjacent(block, next);
 
-        return block;
-    }
+    size_t with_next = block->size + (free_next ? _size_meta_data() + next->size : 0);
+    size_t with_prev = block->size + (free_prev ? _size_meta_data() + prev->size : 0);
+    size_t with_both = with_next + with_prev - block->size;
 
-    block_size += _size_meta_data();
+    ReallocCost costs[NUM_REALLOC_STRATEGIES];
+    bool possible[NUM_REALLOC_STRATEGIES] = {};
 
-    // Try merging with both neighbours
-    if (free_prev && free_next && prev->size + next->size + block_size >= wanted_size) {
-        // remove the free neighbor from free list
-        removeFromFreeList(prev);
-        removeFromFreeList(next);
-        prev->is_free = false;
+    // the free space right after us: nothing moves
+    possible[REALLOC_MERGE_NEXT] = free_next && with_next >= size;
+    costs[REALLOC_MERGE_NEXT] = {0, 0};
 
-        // copy the data to the start of the new block
-        void* copy_from = (char*)block + _size_meta_data();
-        void* copy_to = (char*)prev + _size_meta_data();
-        memmove(copy_to, copy_from, block->size);
+    possible[REALLOC_EXTEND_WILDERNESS] = block == wilderness && atProgramBreak(block);
+    costs[REALLOC_EXTEND_WILDERNESS] = {0, size - block->size};
 
-        // update new block's size
-        prev->size += 2*_size_meta_data() + block->size + next->size;
+    // a free wilderness right after us: take it and sbrk the rest
+    possible[REALLOC_MERGE_NEXT_WILDERNESS] = free_next && next == wilderness && atProgramBreak(next) && with_next < size;
+    costs[REALLOC_MERGE_NEXT_WILDERNESS] = {0, size - with_next};
 
-        // update heap pointers
-        prev->heap_next = next->heap_next;
-        if (next->heap_next) next->heap_next->heap_prev = prev;
+    // the payload moves down
+    possible[REALLOC_MERGE_PREV] = free_prev && with_prev >= size;
+    costs[REALLOC_MERGE_PREV] = {block->size, 0};
 
-        allocated_blocks -= 2;
-        allocated_bytes += 2*_size_meta_data();
+    possible[REALLOC_MERGE_BOTH] = free_prev && free_next && with_both >= size;
+    costs[REALLOC_MERGE_BOTH] = {block->size, 0};
 
-        // update wilderness if necessary
-        if (next == wilderness) {
-            wilderness = prev;
-        }
+    // first fit elsewhere, may sbrk a new block
+    possible[REALLOC_RELOCATE] = true;
+    costs[REALLOC_RELOCATE] = {block->size, 0};
 
-        return prev;    // return for allocation (not added to free list)
+    size_t best = REALLOC_RELOCATE;
+    for (size_t strategy = REALLOC_RELOCATE; strategy-- > REALLOC_MERGE_NEXT;) {
+        if (possible[strategy] && !cheaper(costs[best], costs[strategy])) best = strategy;
     }
 
-    return nullptr; // merging is not an option
+    return (ReallocStrategy)best;
 }
 
 void cutAllocatedBlock(MallocMetadata* block, size_t size) {
@@ -363,8 +727,67 @@ void cutAllocatedBlock(MallocMetadata* block, size_t size) {
     }
 }
 
-/*------------ASSIGNMENT FUNCTIONS----------------------------------*/
-void* smalloc(size_t size) {
+size_t footprint() {
+    size_t index_bytes = 0;
+    for (size_t heap = SLIFETIME_DEFAULT; heap <= NUM_SUB_HEAPS; heap++) {
+        index_bytes += free_index[heap].capacity * (sizeof(size_t) + sizeof(MallocMetadata*));
+    }
+    return allocated_bytes + _num_meta_data_bytes() + index_bytes;
+}
+
+/**
+ * @param growth - bytes the heap is about to take from the OS, headers included
+ * @return false if that crosses the hard limit
+ */
+bool withinBudget(size_t growth) {
+    if (!memory_budget.soft_limit && !memory_budget.hard_limit) return true;
+
+    size_t current = footprint();
+    size_t after = current + growth;
+    if (memory_budget.hard_limit && after > memory_budget.hard_limit) {
+        budget_stats.hard_failures++;
+        if (memory_budget.soft_limit) over_soft_limit = true; // fail now, make room for the next one
+        return false;
+    }
+
+    // crossing the soft limit, or growing well past what the last reclaim left
+    size_t trigger = current <= memory_budget.soft_limit ? memory_budget.soft_limit : reclaim_mark;
+    if (memory_budget.soft_limit && after > trigger) over_soft_limit = true;
+    return true;
+}
+
+/**
+ * @param block - a new mmap'ed block, added to the mmap'ed blocks list
+ */
+void linkMmapped(MallocMetadata* block) {
+    MallocMetadata* prev = nullptr;
+    MallocMetadata* next = mmap_head;
+    while (next && next < block) {
+        prev = next;
+        next = next->heap_next;
+    }
+
+    block->next_free = nullptr;
+    block->prev_free = nullptr;
+    block->heap_prev = prev;
+    block->heap_next = next;
+    if (prev) prev->heap_next = block;
+    else mmap_head = block;
+    if (next) next->heap_prev = block;
+}
+
+void unlinkMmapped(MallocMetadata* block) {
+    if (block->heap_prev) block->heap_prev->heap_next = block->heap_next;
+    else mmap_head = block->heap_next;
+    if (block->heap_next) block->heap_next->heap_prev = block->heap_prev;
+    mmap_changes++;
+}
+
+/**
+ * @param size - aligned
+ * @return a new block at the program break, the wilderness from now on
+ */
+MallocMetadata* sbrkBlock(size_t size) {
     // if FIRST ALLOC
     if (!heap_head) {
         void* program_break = sbrk(0);
@@ -377,63 +800,7 @@ void* smalloc(size_t size) {
         }
     }
 
-    // check conditions
-    if (size == 0 || size > MAX_ALLOC) return nullptr;
-
-    // align size
-    size = align(size);
-
-    // if size >= 128*1024 use mmap (+_size_meta_data())
-    if (size >= MMAP_THRESHOLD) {
-        MallocMetadata* alloc = (MallocMetadata*) mmap(NULL, _size_meta_data() + size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-        if(alloc == MAP_FAILED) return nullptr; // something went wrong
-
-        alloc->size = size;
-        alloc->is_mmap = true;
-        alloc->is_free = false;
-
-        // update allocated vars
-        allocated_blocks++;
-        allocated_bytes += size;
-
-        return (char*)alloc + _size_meta_data();
-    }
-
-    // find the first free block that have enough size
-    MallocMetadata* to_alloc = dummy_free.next_free;
-    while (to_alloc) {
-        if (to_alloc->size >= size) break;
-        to_alloc = to_alloc->next_free;
-    }
-    if (to_alloc) { // we found a block!
-        // if block large enough, cut it
-        if (LARGE_ENOUGH(to_alloc, size)) {
-            cutBlocks(to_alloc, size);
-        }
-
-        // mark block as alloced
-        to_alloc->is_free = false;
-
-        // remove from list (+ update global variables)
-        removeFromFreeList(to_alloc);
-
-        // return the address after the metadata
-        return (char*)to_alloc + _size_meta_data();
-    }
-
-    // if no free block was found And the wilderness chunk is free
-    if (wilderness && wilderness->is_free) {
-        // remove wilderness from free list
-        // (+ update global variables)
-        removeFromFreeList(wilderness);
-        wilderness->is_free = false;
-
-        // enlarge the wilderness (sbrk)
-        void* res = enlargeWilderness(size);
-        if (res == nullptr) return nullptr; // something went wrong
-
-        return res; // (pointer already includes metadata offset)
-    }
+    if (!withinBudget(_size_meta_data() + size)) return nullptr;
 
     // the previous program break will be the new block's place
     MallocMetadata* new_block = (MallocMetadata*) sbrk(0);
@@ -447,6 +814,9 @@ void* smalloc(size_t size) {
     new_block->size = size;
     new_block->is_mmap = false;
     new_block->is_free = false;
+    new_block->heap = SLIFETIME_DEFAULT;
+    new_block->is_movable = false;
+    new_block->is_reserved = false;
     new_block->next_free = nullptr;
     new_block->prev_free = nullptr;
     new_block->heap_next = nullptr;
@@ -466,106 +836,1785 @@ void* smalloc(size_t size) {
     allocated_blocks++;
     allocated_bytes += size;
 
-    // when return, don't forget the offset
-    return (char*)new_block + _size_meta_data();
+    return new_block;
 }
 
-void* scalloc(size_t num, size_t size) {
-    // use smalloc with num * size
-    void* alloc = smalloc(num * size);
-    if (!alloc) return nullptr;
+/**
+ * faults in the pages of [p, p + size) now instead of on first touch, keeping their bytes
+ */
+void populate(char* p, size_t size) {
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(pageFloor(p), pageCeil(p + size) - pageFloor(p), MADV_POPULATE_WRITE) == 0) return;
+#endif
+    // older kernels: write a byte of each page back
+    size_t page_size = getpagesize();
+    for (volatile char* q = p; q < p + size; q += page_size) *q = *q;
+    volatile char* last = p + size - 1;
+    *last = *last;
+}
 
-    // if mmaped no need to nullify
-    if (((MallocMetadata*)((char*)alloc - _size_meta_data()))->is_mmap) return alloc;
+/**
+ * @param meta - an sreserve buffer
+ * @return the bytes reserved after its payload, kept just before its header
+ */
+size_t& reservedSize(MallocMetadata* meta) {
+    return *(size_t*)((char*)meta - sizeof(size_t));
+}
 
-    // nullify with memset
-    memset(alloc, 0, num * size);
+/**
+ * @param meta - an sreserve buffer
+ * @param size - at most its reserved size
+ * @return false if the pages can't be committed (or the budget is exceeded)
+ */
+bool commitReserved(MallocMetadata* meta, size_t size) {
+    size_t page_size = getpagesize();
+    size_t wanted = (size + page_size - 1) & ~(page_size - 1);
+    size_t committed = meta->size;
+    char* p = (char*)meta + _size_meta_data();
+
+    if (wanted > committed) {
+        if (!withinBudget(wanted - committed)) return false;
+        if (mprotect(p + committed, wanted - committed, PROT_READ | PROT_WRITE) != 0) return false;
+        allocated_bytes += wanted - committed;
+    } else if (wanted < committed) {
+        // a fresh reserved mapping on top drops the pages, they read as zeros if committed again
+        void* res = mmap(p + wanted, committed - wanted, PROT_NONE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE | MAP_FIXED, -1, 0);
+        if (res == MAP_FAILED) return false;
+        allocated_bytes -= committed - wanted;
+    }
 
-    return alloc;
+    meta->size = wanted;
+    return true;
 }
 
-void sfree(void* p) {
-    // check if null or released
-    if (!p) return;
-    MallocMetadata* meta = (MallocMetadata*) ((char*)p - _size_meta_data());
-    if (meta->is_free) return;
+/**
+ * @param alignment - a power of 2, larger than a page is fine
+ * @return an mmap'ed block whose payload is aligned, the unused pages around it are unmapped
+ */
+void* mmapAligned(size_t alignment, size_t size) {
+    if (!withinBudget(_size_meta_data() + size)) return nullptr;
+
+    size_t total = _size_meta_data() + size + alignment;
+    char* base = (char*) mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (base == MAP_FAILED) return nullptr; // something went wrong
+
+    char* p = (char*)(((size_t)base + _size_meta_data() + alignment - 1) & ~(alignment - 1));
+    auto alloc = (MallocMetadata*)(p - _size_meta_data());
+
+    // give back whole pages before the metadata and after the payload
+    char* start = pageFloor(alloc);
+    char* end = pageFloor(p + size + getpagesize() - 1);
+    if (start > base) munmap(base, start - base);
+    if (base + total > end) munmap(end, base + total - end);
+
+    alloc->size = size;
+    alloc->is_mmap = true;
+    alloc->is_free = false;
+    alloc->heap = SLIFETIME_DEFAULT;
+    alloc->is_movable = false;
+    alloc->is_reserved = false;
+    linkMmapped(alloc);
 
-    // if block is mmap'ed than munmap
-    if (meta->is_mmap) {
-        // update allocated_blocks, allocated_bytes
-        allocated_blocks--;
-        allocated_bytes -= meta->size;
+    allocated_blocks++;
+    allocated_bytes += size;
 
-        // unmap
-        assert(munmap(meta, meta->size + _size_meta_data()) == 0);
+    return p;
+}
 
-        return;
-    }
+/**
+ * @param block - an allocated heap block
+ * @param aligned - an address inside its payload, at least _size_meta_data() + 8 bytes after the start
+ * the bytes before aligned become a free block of their own
+ * @return the block that starts at aligned
+ */
+MallocMetadata* splitAtAddress(MallocMetadata* block, char* aligned) {
+    char* start = (char*)block + _size_meta_data();
+    auto new_block = (MallocMetadata*)(aligned - _size_meta_data());
 
-    // mark as released
-    meta->is_free = true;
+    new_block->size = start + block->size - aligned;
+    new_block->is_free = false;
+    new_block->is_mmap = false;
+    new_block->heap = block->heap;
+    new_block->is_movable = false;
+    new_block->is_reserved = false;
+    new_block->next_free = nullptr;
+    new_block->prev_free = nullptr;
 
-    // add to free list (+update global variables)
-    addToFreeList(meta);
+    // update heap list
+    new_block->heap_next = block->heap_next;
+    new_block->heap_prev = block;
+    if (block->heap_next) block->heap_next->heap_prev = new_block;
+    block->heap_next = new_block;
+    if (block == wilderness) wilderness = new_block;
+
+    block->size = (char*)new_block - start;
+
+    allocated_blocks++;
+    allocated_bytes -= _size_meta_data();
+
+    // release the leading part (+ combine with a free previous block)
+    freeBlock(start);
+
+    return new_block;
+}
+
+/**
+ * @param arena - its current chunk can't fit size
+ * moves to the next kept chunk that fits, or allocates a new one after current
+ */
+bool nextArenaChunk(SArena* arena, size_t size) {
+    ArenaChunk* chunk = arena->current ? arena->current->next : nullptr;
+    while (chunk && chunk->size < size) chunk = chunk->next;
+
+    if (!chunk) {
+        size_t chunk_size = size > arena->chunk_size ? size : arena->chunk_size;
+        chunk = (ArenaChunk*) smalloc(sizeof(ArenaChunk) + chunk_size);
+        if (!chunk) return false;
+        chunk->size = chunk_size;
+
+        // insert after current, so a reset walks every chunk in order
+        if (arena->current) {
+            chunk->next = arena->current->next;
+            arena->current->next = chunk;
+        } else {
+            chunk->next = nullptr;
+            arena->first = chunk;
+        }
+    }
+
+    arena->current = chunk;
+    arena->bump = (char*)chunk + sizeof(ArenaChunk);
+    arena->end = arena->bump + chunk->size;
+
+    return true;
+}
+
+/**
+ * @param block - a free block, idle for at least idle_ticks passes
+ * @return the bytes given back with madvise (its header and stamp stay)
+ */
+size_t purgeBlock(MallocMetadata* block, size_t idle_ticks) {
+    if (block->size < sizeof(FreeStamp)) return 0;
+
+    auto stamp = (FreeStamp*)((char*)block + _size_meta_data());
+    if (stamp->purged || purge_clock - stamp->freed_at < idle_ticks) return 0;
+
+    char* start = pageCeil((char*)stamp + sizeof(FreeStamp));
+    char* end = pageFloor((char*)stamp + block->size);
+    if (end <= start) return 0;
+
+    // the pages read as zeros when the block is used again
+    if (madvise(start, end - start, MADV_DONTNEED) != 0) return 0;
+    stamp->purged = 1;
+
+    return end - start;
+}
+
+/**
+ * gives an idle free wilderness back with a negative sbrk
+ * @return the bytes released
+ */
+size_t trimWilderness(size_t idle_ticks) {
+    if (!wilderness || !wilderness->is_free || !atProgramBreak(wilderness)) return 0;
+    if (wilderness->size >= sizeof(FreeStamp)) {
+        auto stamp = (FreeStamp*)((char*)wilderness + _size_meta_data());
+        if (purge_clock - stamp->freed_at < idle_ticks) return 0;
+    }
+
+    MallocMetadata* block = wilderness;
+    size_t size = block->size;
+    MallocMetadata* prev = block->heap_prev; // the header is gone after the sbrk
+    size_t released = _size_meta_data() + size;
+
+    removeFromFreeList(block);
+    if (sbrk(-(intptr_t)released) == (void*)(-1)) {
+        addToFreeList(block);
+        return 0;
+    }
+
+    // unlink the block, its previous neighbour is the new wilderness
+    wilderness = prev;
+    if (wilderness) wilderness->heap_next = nullptr;
+    else heap_head = nullptr;
+
+    allocated_blocks--;
+    allocated_bytes -= size;
+
+    return released;
+}
+
+/**
+ * @param heap - whose free list to search
+ * @return the first free block that fits size, cut to size and taken off the list, or nullptr
+ */
+MallocMetadata* takeFreeBlock(size_t heap, size_t size) {
+    // find the first free block that have enough size
+    MallocMetadata* to_alloc = firstFit(heap, size);
+    if (!to_alloc) return nullptr;
+
+    // if block large enough, cut it
+    if (LARGE_ENOUGH(to_alloc, size)) {
+        cutBlocks(to_alloc, size);
+    }
+
+    // mark block as alloced
+    to_alloc->is_free = false;
+
+    // remove from list (+ update global variables)
+    removeFromFreeList(to_alloc);
+
+    return to_alloc;
+}
+
+/**
+ * @return the size of the free block a new segment starts with
+ */
+size_t segmentPayload() {
+    return SEGMENT_SIZE - sizeof(Segment) - _size_meta_data();
+}
+
+/**
+ * maps a new segment for a sub-heap, as one free block
+ */
+bool addSegment(size_t heap) {
+    if (!withinBudget(SEGMENT_SIZE - sizeof(Segment))) return false;
+
+    auto segment = (Segment*) mmap(NULL, SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (segment == MAP_FAILED) return false; // something went wrong
+
+    // keep the segments sorted by address, for heap walks
+    SubHeap& sub = sub_heaps[heap - 1];
+    Segment* prev = nullptr;
+    Segment* next = sub.segments;
+    while (next && next < segment) {
+        prev = next;
+        next = next->next;
+    }
+    segment->prev = prev;
+    segment->next = next;
+    if (prev) prev->next = segment;
+    else sub.segments = segment;
+    if (next) next->prev = segment;
+    sub.num_segments++;
+
+    auto block = (MallocMetadata*)((char*)segment + sizeof(Segment));
+    block->size = segmentPayload();
+    block->is_mmap = false;
+    block->heap = heap;
+    block->is_movable = false;
+    block->is_reserved = false;
+    block->heap_next = nullptr;
+    block->heap_prev = nullptr;
+
+    allocated_blocks++;
+    allocated_bytes += block->size;
+
+    addToFreeList(block);
+    markFreed(block);
+    return true;
+}
+
+/**
+ * @param block - a free block that covers its whole segment, unmapped unless it's the last one
+ */
+void releaseSegment(MallocMetadata* block) {
+    SubHeap& sub = sub_heaps[block->heap - 1];
+    if (sub.num_segments == 1) return; // saves a mmap when the next request comes
+
+    removeFromFreeList(block);
+    allocated_blocks--;
+    allocated_bytes -= block->size;
+
+    auto segment = (Segment*)((char*)block - sizeof(Segment));
+    if (segment->prev) segment->prev->next = segment->next;
+    else sub.segments = segment->next;
+    if (segment->next) segment->next->prev = segment->prev;
+    sub.num_segments--;
+
+    int res = munmap(segment, SEGMENT_SIZE);
+    assert(res == 0);
+    (void)res;
+}
+
+/**
+ * @return an unused handle entry, entries are taken in chunks and never freed.
+ * the chunks live in the long lived sub-heap, where they don't pin the blocks scompact moves
+ */
+SHandleEntry* newHandle() {
+    if (!free_handles) {
+        auto chunk = (SHandleEntry*) allocHinted(HANDLES_PER_CHUNK * sizeof(SHandleEntry), SLIFETIME_LONG);
+        if (!chunk) return nullptr;
+
+        for (size_t i = 0; i < HANDLES_PER_CHUNK; i++) {
+            chunk[i].next_free = free_handles;
+            free_handles = &chunk[i];
+        }
+    }
+
+    SHandleEntry* entry = free_handles;
+    free_handles = entry->next_free;
+    return entry;
+}
+
+/**
+ * @param block - a free block of the sbrk heap
+ * @return true if its heap neighbour is an unlocked handle's block right after it
+ */
+bool canSlide(MallocMetadata* block) {
+    MallocMetadata* next = block->heap_next;
+    if (!next || next->is_free || !next->is_movable || !isAdjacent(block, next)) return false;
+
+    auto entry = *(SHandleEntry**)((char*)next + _size_meta_data());
+    return entry->locks == 0;
+}
+
+/**
+ * moves the block after hole down into it, the free space ends up after the moved block
+ * @param hole - a free block that canSlide
+ * @return the free block after the moved one (merged with its next neighbour)
+ */
+MallocMetadata* slideBlock(MallocMetadata* hole) {
+    MallocMetadata* block = hole->heap_next;
+    MallocMetadata* prev = hole->heap_prev;
+    MallocMetadata* next = block->heap_next;
+    size_t hole_size = hole->size;
+    bool was_wilderness = block == wilderness;
+
+    removeFromFreeList(hole);
+
+    // header and payload, the ranges may overlap
+    size_t moved_bytes = _size_meta_data() + block->size;
+    memmove(hole, block, moved_bytes);
+    MallocMetadata* moved = hole;
+
+    auto entry = *(SHandleEntry**)((char*)moved + _size_meta_data());
+    entry->ptr = (char*)moved + _size_meta_data() + sizeof(SHandleEntry*);
+
+    // the free space, same size as before, right after the moved block
+    auto free_block = (MallocMetadata*)((char*)moved + moved_bytes);
+    free_block->size = hole_size;
+    free_block->is_mmap = false;
+    free_block->heap = SLIFETIME_DEFAULT;
+    free_block->is_movable = false;
+    free_block->is_reserved = false;
+
+    // update heap list
+    moved->heap_prev = prev;
+    if (prev) prev->heap_next = moved;
+    else heap_head = moved;
+    moved->heap_next = free_block;
+    free_block->heap_prev = moved;
+    free_block->heap_next = next;
+    if (next) next->heap_prev = free_block;
+    if (was_wilderness) wilderness = free_block;
+
+    compact_stats.moved_blocks++;
+    compact_stats.moved_bytes += moved_bytes;
+
+    addToFreeList(free_block);
+    MallocMetadata* merged = combineBlocks(free_block);
+    markFreed(merged);
+
+    return merged;
+}
+
+void setThreshold(size_t threshold, size_t trigger_size) {
+    if (threshold == mmap_threshold) return;
+
+    threshold_history[threshold_changes % THRESHOLD_HISTORY] = {threshold, trigger_size, threshold > mmap_threshold};
+    threshold_changes++;
+    mmap_threshold = threshold;
+}
+
+/**
+ * @param size - of an mmap'ed block being freed: blocks of this size are
+ *               worth keeping on the heap (like glibc's dynamic threshold)
+ */
+void adaptToMmapFree(size_t size) {
+    // the threshold would pass max
+    if (!threshold_adaptive || size < mmap_threshold || size + 8 > threshold_bounds.max) return;
+
+    setThreshold(size + 8, size); // the next block of this size stays on the heap
+}
+
+/**
+ * @param block - a free heap block just merged
+ * large free blocks that pile up inside the heap mean large blocks should be mmap'ed again
+ */
+void adaptToHeapFree(MallocMetadata* block) {
+    if (!threshold_adaptive || mmap_threshold <= threshold_bounds.min) return;
+    if (block->size < threshold_bounds.min || block == wilderness) return;
+    if (free_bytes * FRAGMENTATION_LIMIT <= allocated_bytes) return;
+
+    size_t threshold = mmap_threshold / 2;
+    if (threshold < threshold_bounds.min) threshold = threshold_bounds.min;
+    setThreshold(threshold, block->size);
+}
+
+/**
+ * trims the wilderness, flushes the cache in front of the heap, purges free pages
+ * and runs the callbacks until the footprint is under the soft limit (reclaiming set)
+ * @return false if the cache can't be flushed on this thread now
+ */
+bool reclaimPass() {
+    drainDeferred(0);
+
+    bool (*flush)();
+    {
+        HeapGuard guard;
+        purge_stats.trimmed_bytes += trimWilderness(0);
+        flush = cache_flush;
+    }
+
+    if (flush && !flush()) return false;
+    spurge(0, RECLAIM_MAX_BLOCKS);
+
+    for (size_t i = 0;; i++) {
+        ReclaimCallback entry;
+        size_t excess;
+        {
+            HeapGuard guard;
+            size_t current = footprint();
+            if (i >= num_reclaim_callbacks || !memory_budget.soft_limit || current <= memory_budget.soft_limit) break;
+            entry = reclaim_callbacks[i];
+            excess = current - memory_budget.soft_limit;
+        }
+        entry.callback(excess, entry.context);
+    }
+    return true;
+}
+
+/**
+ * the calling thread took the heap past the soft limit and holds no lock of ours
+ */
+void reclaimBudget() {
+    over_soft_limit = false;
+
+    size_t before;
+    {
+        HeapGuard guard;
+        if (reclaiming) {
+            reclaim_requested = true; // the reclaiming thread goes again
+            return;
+        }
+        reclaiming = true;
+        before = footprint();
+    }
+
+    bool flushed;
+    while (true) {
+        flushed = reclaimPass();
+
+        HeapGuard guard;
+        size_t after = footprint();
+        if (flushed) budget_stats.reclaims++;
+        if (after < before) budget_stats.reclaimed_bytes += before - after;
+
+        // other threads crossed it meanwhile, go again while it pays off
+        bool again = flushed && reclaim_requested && after < before && after > memory_budget.soft_limit;
+        reclaim_requested = false;
+        if (!again) {
+            reclaiming = false;
+            reclaim_mark = after + memory_budget.soft_limit / 8;
+            over_soft_limit = false; // callbacks that allocated wait for the next crossing
+            break;
+        }
+        before = after;
+    }
+
+    if (!flushed) over_soft_limit = true; // retried when this thread next releases the lock
+}
+
+MallocMetadata* firstBlockOf(Segment* segment) {
+    return (MallocMetadata*)((char*)segment + sizeof(Segment));
+}
+
+/**
+ * @return the first block of the part walk is in, walk.segment is set for a sub-heap
+ */
+MallocMetadata* walkStart(SHeapWalk& walk) {
+    if (walk.part == SLIFETIME_DEFAULT) return heap_head;
+    if (walk.part == WALK_MMAP) return mmap_head;
+
+    Segment* segment = sub_heaps[walk.part - 1].segments;
+    walk.segment = segment;
+    return segment ? firstBlockOf(segment) : nullptr;
+}
+
+/**
+ * @return the block after block in the part walk is in, nullptr at its end
+ */
+MallocMetadata* walkAfter(SHeapWalk& walk, MallocMetadata* block) {
+    if (block->heap_next || walk.part == SLIFETIME_DEFAULT || walk.part == WALK_MMAP) return block->heap_next;
+
+    Segment* segment = ((Segment*)walk.segment)->next;
+    walk.segment = segment;
+    return segment ? firstBlockOf(segment) : nullptr;
+}
+
+/**
+ * the blocks changed since walk.last was visited, it may not even exist anymore.
+ * every part is sorted by address, so the walk goes on from the first block after it
+ */
+MallocMetadata* walkResume(SHeapWalk& walk) {
+    auto last = (MallocMetadata*)walk.last;
+
+    if (walk.part == SLIFETIME_DEFAULT) {
+        // the free block before it is still a block, found by binary search
+        MallocMetadata* block = heap_head;
+        FreeIndex& index = free_index[SLIFETIME_DEFAULT];
+        if (!index.broken) {
+            size_t position = indexPosition(index, last);
+            if (position > 0) block = index.blocks[position - 1];
+        }
+        while (block && block <= last) block = block->heap_next;
+        return block;
+    }
+
+    if (walk.part == WALK_MMAP) {
+        MallocMetadata* block = mmap_head;
+        while (block && block <= last) block = block->heap_next;
+        return block;
+    }
+
+    for (Segment* segment = sub_heaps[walk.part - 1].segments; segment; segment = segment->next) {
+        if ((char*)segment + SEGMENT_SIZE <= (char*)last) continue;
+
+        walk.segment = segment;
+        MallocMetadata* block = firstBlockOf(segment);
+        while (block && block <= last) block = block->heap_next;
+        if (block) return block;
+    }
+    return nullptr;
+}
+
+/**
+ * visits up to max_blocks blocks from where walk stopped: the sbrk heap, each
+ * sub-heap, then the mmap'ed blocks
+ * @param last_part - the walk ends after this part, WALK_MMAP for every block
+ * @param visit - called with each block and the part it's in
+ * @return false once every block was visited
+ */
+bool walkHeap(SHeapWalk& walk, size_t last_part, size_t max_blocks, void (*visit)(MallocMetadata*, size_t, void*),
+              void* context) {
+    if (walk.part > last_part) return false;
+
+    auto block = (MallocMetadata*)walk.next;
+    if (!walk.last) {
+        block = walkStart(walk);
+    } else if (walk.free_list_changes != free_list_changes || walk.mmap_changes != mmap_changes) {
+        block = walkResume(walk);
+    }
+
+    size_t visited = 0;
+    while (walk.part <= last_part) {
+        if (!block) {
+            walk.part++;
+            walk.last = nullptr;
+            if (walk.part <= last_part) block = walkStart(walk);
+            continue;
+        }
+        if (visited == max_blocks) break;
+
+        visit(block, walk.part, context);
+        visited++;
+        walk.last = block;
+        block = walkAfter(walk, block);
+    }
+
+    walk.next = block;
+    walk.free_list_changes = free_list_changes;
+    walk.mmap_changes = mmap_changes;
+    return walk.part <= last_part;
+}
+
+/**
+ * @return i for a size in [2^i, 2^(i+1)), the last bucket takes everything larger
+ */
+size_t sizeBucket(size_t size) {
+    size_t bucket = 0;
+    while (size >>= 1) bucket++;
+    return bucket < SHEAP_SIZE_BUCKETS ? bucket : SHEAP_SIZE_BUCKETS - 1;
+}
+
+void countBlock(MallocMetadata* block, size_t part, void* context) {
+    auto snapshot = (SHeapSnapshot*)context;
+    size_t bucket = sizeBucket(block->size);
+
+    if (block->is_free) {
+        snapshot->free_blocks++;
+        snapshot->free_bytes += block->size;
+        snapshot->free_sizes[bucket]++;
+        if (block->size > snapshot->largest_free) snapshot->largest_free = block->size;
+        return;
+    }
+
+    snapshot->used_blocks++;
+    snapshot->used_bytes += block->size;
+    snapshot->used_sizes[bucket]++;
+    if (part == WALK_MMAP) {
+        snapshot->mmap_blocks++;
+        snapshot->mmap_bytes += block->size;
+    }
+}
+
+/**
+ * @return the profile bucket of a block size: 16 byte steps up to 1KB, then 4 per power of 2
+ */
+size_t profileBucket(size_t size) {
+    if (size <= 1024) return (size + 15) / 16;
+
+    size_t lg = 63 - __builtin_clzl(size - 1);  // 2^lg < size <= 2^(lg+1)
+    size_t quarter = ((size - 1) >> (lg - 2)) & 3;
+    size_t bucket = 65 + (lg - 10) * 4 + quarter;
+    return bucket < PROFILE_BUCKETS ? bucket : PROFILE_BUCKETS - 1;
+}
+
+/**
+ * @return the largest size of a bucket
+ */
+size_t bucketSize(size_t bucket) {
+    if (bucket <= 64) return bucket * 16;
+
+    size_t lg = (bucket - 65) / 4 + 10;
+    return ((size_t)1 << lg) + ((bucket - 65) % 4 + 1) * ((size_t)1 << (lg - 2));
+}
+
+// live blocks of the sbrk heap by profileBucket
+struct SizeProfile {
+    size_t counts[PROFILE_BUCKETS];
+    size_t max_bytes;   // what sprewarm may grow the heap by, 0 for no cap
+};
+
+struct ProfileRecord {
+    size_t size;
+    size_t count;
+};
+
+void profileBlock(MallocMetadata* block, size_t part, void* context) {
+    if (part != SLIFETIME_DEFAULT || block->is_free) return;
+
+    auto profile = (SizeProfile*)context;
+    profile->counts[profileBucket(block->size)]++;
+}
+
+/**
+ * grows the heap by the profile at once and faults it in, as one free block:
+ * first fit goes by address, so blocks cut ahead of time would only be scanned past.
+ * smallocs split it from the front (heap_lock not held)
+ */
+bool prewarmHeap(const SizeProfile& profile) {
+    // saturates, a profile file may hold any counts
+    size_t total = 0;
+    for (size_t bucket = 0; bucket < PROFILE_BUCKETS; bucket++) {
+        size_t bytes;
+        if (__builtin_mul_overflow(profile.counts[bucket], _size_meta_data() + bucketSize(bucket), &bytes) ||
+            __builtin_add_overflow(total, bytes, &total)) {
+            total = (size_t)-1;
+            break;
+        }
+    }
+    if (profile.max_bytes && total > profile.max_bytes) total = profile.max_bytes;
+    if (total > MAX_ALLOC) total = MAX_ALLOC;
+    if (total <= _size_meta_data()) return false;
+
+    MallocMetadata* block;
+    {
+        HeapGuard guard;
+        block = sbrkBlock(align(total - _size_meta_data()));
+    }
+    if (!block) return false;
+
+    // no one else sees the block yet, the page faults happen without the lock
+    populate((char*)block + _size_meta_data(), block->size);
+
+    HeapGuard guard;
+    block->is_free = true;
+    addToFreeList(block);
+    markFreed(combineBlocks(block));
+
+    return true;
+}
+
+void* prewarmMain(void* profile) {
+    prewarmHeap(*(SizeProfile*)profile);
+    sfree(profile);
+    return nullptr;
+}
+
+// the records of one sheap_write_map step, written once the heap lock is released
+struct MapBuffer {
+    SHeapMapRecord records[MAP_BUFFER_RECORDS];
+    size_t count;
+};
+
+void recordBlock(MallocMetadata* block, size_t part, void* context) {
+    auto buffer = (MapBuffer*)context;
+    assert(buffer->count < MAP_BUFFER_RECORDS);
+
+    SHeapMapRecord& record = buffer->records[buffer->count++];
+    record.address = (size_t)block + _size_meta_data();
+    record.size_flags = block->size | (part << SHEAP_MAP_PART_SHIFT) | (block->is_free ? SHEAP_MAP_FREE : 0);
+}
+
+bool writeAll(int fd, const void* data, size_t size) {
+    auto bytes = (const char*)data;
+    while (size > 0) {
+        ssize_t written = write(fd, bytes, size);
+        if (written < 0) return false;
+        bytes += written;
+        size -= written;
+    }
+    return true;
+}
+
+/*------------BLOCK FUNCTIONS (heap_lock held)----------------------*/
+/**
+ * charges a block the public functions hand out to the thread's tag, the
+ * internal ones (allocBlock, freeBlock...) don't, so sreallocs aren't counted twice
+ * @param p - the payload, may be nullptr
+ */
+void tagBlock(void* p) {
+    if (!p) return;
+    auto meta = (MallocMetadata*)((char*)p - _size_meta_data());
+
+    meta->tag = current_tag;
+    STagStats& stats = tag_stats[meta->tag];
+    stats.live_bytes += meta->size;
+    stats.live_blocks++;
+    stats.allocations++;
+    stats.allocated_bytes += meta->size;
+}
+
+/**
+ * @param p - the payload of a block about to be freed, may be nullptr
+ */
+void untagBlock(void* p) {
+    if (!p) return;
+    auto meta = (MallocMetadata*)((char*)p - _size_meta_data());
+    if (meta->is_free) return;
+    assert(meta->tag < STAG_MAX);
+
+    STagStats& stats = tag_stats[meta->tag];
+    stats.live_bytes -= meta->size;
+    stats.live_blocks--;
+    stats.frees++;
+}
+
+/**
+ * @param meta - a block that was old_size, it may have moved (reallocated) or resized in place
+ */
+void retagBlock(MallocMetadata* meta, STag tag, size_t old_size) {
+    meta->tag = tag;
+    STagStats& stats = tag_stats[tag];
+    stats.live_bytes += meta->size - old_size;
+    if (meta->size > old_size) stats.allocated_bytes += meta->size - old_size;
+}
+
+/**
+ * @param head - a list of deferred blocks ending at tail, pushed with one CAS
+ */
+void pushDeferred(DeferredFree* head, DeferredFree* tail) {
+    DeferredFree* top = deferred_head.load(std::memory_order_relaxed);
+    do {
+        tail->next = top;
+    } while (!deferred_head.compare_exchange_weak(top, head, std::memory_order_release, std::memory_order_relaxed));
+}
+
+/**
+ * frees queued blocks, DEFERRED_BATCH per heap lock hold (heap_lock not held)
+ * @param max_blocks - 0 for every one, the rest goes back on the queue
+ */
+size_t drainDeferred(size_t max_blocks) {
+    DeferredFree* list = deferred_head.exchange(nullptr, std::memory_order_acquire);
+
+    size_t drained = 0;
+    while (list && (!max_blocks || drained < max_blocks)) {
+        size_t bytes = 0, blocks = 0;
+        {
+            HeapGuard guard;
+            while (list && blocks < DEFERRED_BATCH && (!max_blocks || drained + blocks < max_blocks)) {
+                DeferredFree* next = list->next;
+                bytes += ((MallocMetadata*)((char*)list - _size_meta_data()))->size;
+                untagBlock(list);
+                freeBlock(list);
+                list = next;
+                blocks++;
+            }
+        }
+
+        drained += blocks;
+        deferred_blocks.fetch_sub(blocks, std::memory_order_relaxed);
+        deferred_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+    }
+    drained_blocks.fetch_add(drained, std::memory_order_relaxed);
+
+    if (list) {
+        DeferredFree* tail = list;
+        while (tail->next) tail = tail->next;
+        pushDeferred(list, tail);
+    }
+    return drained;
+}
+
+void* drainerMain(void*) {
+    pthread_mutex_lock(&drainer_lock);
+
+    while (!drainer_stopping) {
+        timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += drainer_period_ms / 1000;
+        deadline.tv_nsec += (drainer_period_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        pthread_cond_timedwait(&drainer_wakeup, &drainer_lock, &deadline);
+        if (drainer_stopping) break;
+        pthread_mutex_unlock(&drainer_lock);
+
+        drainDeferred(0);
+
+        pthread_mutex_lock(&drainer_lock);
+    }
+
+    pthread_mutex_unlock(&drainer_lock);
+    return nullptr;
+}
+
+void* allocBlock(size_t size) {
+    // check conditions
+    if (size == 0 || size > MAX_ALLOC) return nullptr;
+
+    // align size
+    size = align(size);
+
+    // if size >= mmap_threshold (128*1024 unless adaptive) use mmap (+_size_meta_data())
+    if (size >= mmap_threshold) {
+        if (!withinBudget(_size_meta_data() + size)) return nullptr;
+
+        MallocMetadata* alloc = (MallocMetadata*) mmap(NULL, _size_meta_data() + size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if(alloc == MAP_FAILED) return nullptr; // something went wrong
+
+        alloc->size = size;
+        alloc->is_mmap = true;
+        alloc->is_free = false;
+        alloc->heap = SLIFETIME_DEFAULT;
+        alloc->is_movable = false;
+        alloc->is_reserved = false;
+        linkMmapped(alloc);
+
+        // update allocated vars
+        allocated_blocks++;
+        allocated_bytes += size;
+
+        return (char*)alloc + _size_meta_data();
+    }
+
+    MallocMetadata* to_alloc = takeFreeBlock(SLIFETIME_DEFAULT, size);
+    if (to_alloc) { // we found a block!
+        // return the address after the metadata
+        return (char*)to_alloc + _size_meta_data();
+    }
+
+    // if no free block was found And the wilderness chunk is free
+    if (wilderness && wilderness->is_free && atProgramBreak(wilderness)) {
+        if (!withinBudget(size - wilderness->size)) return nullptr;
+
+        // remove wilderness from free list
+        // (+ update global variables)
+        removeFromFreeList(wilderness);
+        wilderness->is_free = false;
+
+        // enlarge the wilderness (sbrk)
+        void* res = enlargeWilderness(size);
+        if (res == nullptr) { // something went wrong, it stays free
+            wilderness->is_free = true;
+            addToFreeList(wilderness);
+            return nullptr;
+        }
+
+        return res; // (pointer already includes metadata offset)
+    }
+
+    MallocMetadata* new_block = sbrkBlock(size);
+    if (!new_block) return nullptr;
+
+    // when return, don't forget the offset
+    return (char*)new_block + _size_meta_data();
+}
+
+/**
+ * @param heap - an SLifetime, SLIFETIME_DEFAULT is the sbrk heap
+ */
+void* allocHinted(size_t size, size_t heap) {
+    // check conditions, large blocks are mmap'ed whatever the hint
+    if (heap == SLIFETIME_DEFAULT || size == 0 || size > MAX_ALLOC) return allocBlock(size);
+    if (align(size) >= mmap_threshold) return allocBlock(size);
+
+    // an adaptive threshold may be over what a segment holds
+    if (align(size) > segmentPayload()) return allocBlock(size);
+
+    size = align(size);
+
+    MallocMetadata* to_alloc = takeFreeBlock(heap, size);
+    if (!to_alloc) {
+        if (!addSegment(heap)) return nullptr;
+        to_alloc = takeFreeBlock(heap, size);
+    }
+    if (!to_alloc) return nullptr;
+
+    return (char*)to_alloc + _size_meta_data();
+}
+
+/**
+ * @param alignment - a power of 2
+ * @param heap - an SLifetime, large blocks are mmap'ed whatever it is
+ */
+void* allocAligned(size_t alignment, size_t size, size_t heap) {
+    // every block is already 8 aligned
+    if (alignment <= 8) return allocHinted(size, heap);
+
+    size = align(size);
+
+    // worst case: a minimal free block in front of the aligned payload
+    size_t padded = size + alignment + _size_meta_data() + 8;
+    if (padded >= mmap_threshold) return mmapAligned(alignment, size);
+
+    char* p = (char*) allocHinted(padded, heap);
+    if (!p) return nullptr;
+    auto block = (MallocMetadata*)(p - _size_meta_data());
+
+    if ((size_t)p % alignment != 0) {
+        char* aligned = (char*)(((size_t)p + _size_meta_data() + 8 + alignment - 1) & ~(alignment - 1));
+        block = splitAtAddress(block, aligned);
+    }
+
+    cutAllocatedBlock(block, size); // give back the tail
+    return (char*)block + _size_meta_data();
+}
+
+void freeBlock(void* p) {
+    // check if null or released
+    if (!p) return;
+    MallocMetadata* meta = (MallocMetadata*) ((char*)p - _size_meta_data());
+    if (meta->is_free) return;
+
+    // if block is mmap'ed than munmap
+    if (meta->is_mmap) {
+        // update allocated_blocks, allocated_bytes
+        allocated_blocks--;
+        allocated_bytes -= meta->size;
+        if (!meta->is_reserved) adaptToMmapFree(meta->size);
+        unlinkMmapped(meta);
+
+        // unmap (aligned blocks may start mid-page, see mmapAligned)
+        char* start = pageFloor(meta);
+        char* end = (char*)p + (meta->is_reserved ? reservedSize(meta) : meta->size);
+        int res = munmap(start, end - start);
+        assert(res == 0);
+        (void)res;
+
+        return;
+    }
+
+    // mark as released
+    meta->is_free = true;
+    meta->is_movable = false;
+
+    // add to free list (+update global variables)
+    addToFreeList(meta);
 
     // call combine
-    combineBlocks(meta);
+    MallocMetadata* merged = combineBlocks(meta);
+    markFreed(merged);
+    adaptToHeapFree(merged);
+
+    // a segment with no live blocks left
+    if (merged->heap != SLIFETIME_DEFAULT && !merged->heap_prev && !merged->heap_next) releaseSegment(merged);
 }
 
-void* srealloc(void* oldp, size_t size) {
+void* reallocBlock(void* oldp, size_t size) {
     // check parameters
-    if (size == 0 || size > MAX_ALLOC) return nullptr;
+    if (size == 0) return nullptr;
 
     // if given null pointer, allocate normally
     if (oldp == nullptr)
-        return smalloc(size);
+        return allocBlock(size);
 
     auto block = (MallocMetadata *) ((char *) oldp - _size_meta_data());
     size_t old_size = block->size;
 
+    // a reserved buffer grows in place while it fits, its reservation is its limit
+    if (block->is_reserved && size <= reservedSize(block) && commitReserved(block, align(size))) {
+        realloc_counts[REALLOC_IN_PLACE]++;
+        return oldp;
+    }
+    if (size > MAX_ALLOC) return nullptr;
+
     // align given size to be a multiple of 8
     size = align(size);
 
     // if old_block is mmap()-ed
     if (block->is_mmap) {
-        // mmap() new block using smalloc (size >= MMAP_THRESHOLD)
+        // mmap() new block using smalloc (size >= mmap_threshold)
         // copy data, and free old block
         return reallocate(oldp, old_size, size);
     }
 
     // if not mmap()=ed and size is smaller
     if (size <= old_size) {
+        realloc_counts[REALLOC_IN_PLACE]++;
         cutAllocatedBlock(block, size); // try to cut block
         return oldp;                    // reuse the same block
     }
 
     // Othewise, need to try and enlarge the block
     // From here onwards size > old_Size
+    ReallocStrategy strategy = chooseRealloc(block, size);
+    MallocMetadata* grown = block;
+
+    switch (strategy) {
+        case REALLOC_MERGE_NEXT:
+            mergeNext(block);
+            break;
+        case REALLOC_MERGE_NEXT_WILDERNESS: {
+            // the heap grows first, the block is left as it was if it can't
+            size_t missing = size - (block->size + _size_meta_data() + wilderness->size);
+            if (!withinBudget(missing) || sbrk(missing) == (void*)(-1)) {
+                strategy = REALLOC_RELOCATE;
+                break;
+            }
+            mergeNext(block); // block is the wilderness now
+            block->size += missing;
+            allocated_bytes += missing;
+            break;
+        }
+        case REALLOC_EXTEND_WILDERNESS:
+            // over budget or sbrk failed, maybe a free block fits
+            if (!withinBudget(size - wilderness->size) || !enlargeWilderness(size)) strategy = REALLOC_RELOCATE;
+            break;
+        case REALLOC_MERGE_PREV:
+            grown = mergePrev(block);
+            break;
+        case REALLOC_MERGE_BOTH:
+            grown = mergePrev(block);
+            mergeNext(grown);
+            break;
+        default:
+            break;
+    }
 
-    // If wilderness block was given
-    if (block == wilderness) {
-        // enlarge wilderness block and update global vars
-        return enlargeWilderness(size);
-        // (pointer already includes metadata offset)
-        // nullptr is returned if something went wrong
-    }
-
-    // try merging with a neighboring free block
-    // after merge the neighbor blocks are not in the free list
-    // and the old data was copied to the beginning of the block
-    MallocMetadata *merged_block = tryMergingNeighbor(block, size);
-    if (!merged_block) {
-        // if merging was not an option
-        // Final option: find new block in heap using smalloc
-        // copy data, and free old block
-        return reallocate(oldp, old_size, size);
+    if (strategy == REALLOC_RELOCATE) return reallocate(oldp, old_size, size);
+
+    realloc_counts[strategy]++;
+    if (strategy == REALLOC_MERGE_PREV || strategy == REALLOC_MERGE_BOTH) realloc_copied_bytes += old_size;
+
+    cutAllocatedBlock(grown, size); // give back what we don't need
+    grown->is_free = false;
+
+    return (char*)grown + _size_meta_data();
+}
+
+/*------------ASSIGNMENT FUNCTIONS----------------------------------*/
+void* smalloc(size_t size) {
+    HeapGuard guard;
+    void* p = allocBlock(size);
+    tagBlock(p);
+    return p;
+}
+
+void* scalloc(size_t num, size_t size) {
+    // use smalloc with num * size
+    void* alloc = smalloc(num * size);
+    if (!alloc) return nullptr;
+
+    // if mmaped no need to nullify
+    if (((MallocMetadata*)((char*)alloc - _size_meta_data()))->is_mmap) return alloc;
+
+    // nullify with memset
+    memset(alloc, 0, num * size);
+
+    return alloc;
+}
+
+void sfree(void* p) {
+    HeapGuard guard;
+    untagBlock(p);
+    freeBlock(p);
+}
+
+void* srealloc(void* oldp, size_t size) {
+    HeapGuard guard;
+    if (!oldp) {
+        void* p = reallocBlock(oldp, size);
+        tagBlock(p);
+        return p;
+    }
+
+    auto old_meta = (MallocMetadata*)((char*)oldp - _size_meta_data());
+    STag tag = old_meta->tag;
+    size_t old_size = old_meta->size;
+
+    void* p = reallocBlock(oldp, size);
+    if (p) retagBlock((MallocMetadata*)((char*)p - _size_meta_data()), tag, old_size);
+    return p;
+}
+
+/*------------EXTENSIONS---------------------------------------------*/
+void* smalloc_hint(size_t size, SLifetime lifetime) {
+    if ((size_t)lifetime > NUM_SUB_HEAPS) return nullptr;
+
+    HeapGuard guard;
+    void* p = allocHinted(size, lifetime);
+    tagBlock(p);
+    return p;
+}
+
+void* smalloc_aligned(size_t alignment, size_t size) {
+    // check parameters
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) return nullptr;
+    if (size == 0 || size > MAX_ALLOC) return nullptr;
+
+    HeapGuard guard;
+    void* p = allocAligned(alignment, size, SLIFETIME_DEFAULT);
+    tagBlock(p);
+    return p;
+}
+
+void* smallocx(size_t size, int flags) {
+    size_t lg_align = flags & SMALLOCX_LG_ALIGN_MASK;
+    size_t alignment = lg_align ? (size_t)1 << lg_align : 8;
+    size_t heap = (flags >> SMALLOCX_HEAP_SHIFT) & 3;
+    if (heap > NUM_SUB_HEAPS || size == 0 || size > MAX_ALLOC) return nullptr;
+
+    // a huge page can only back a block that covers it
+    if ((flags & SMALLOCX_HUGEPAGE) && size >= HUGE_PAGE_SIZE && alignment < HUGE_PAGE_SIZE) alignment = HUGE_PAGE_SIZE;
+
+    char* p;
+    {
+        HeapGuard guard;
+        p = (char*) allocAligned(alignment, size, heap);
+        tagBlock(p);
+    }
+    if (!p) return nullptr;
+    auto meta = (MallocMetadata*)(p - _size_meta_data());
+
+    if (flags & SMALLOCX_HUGEPAGE) {
+        char* start = pageCeil(p);
+        char* end = pageFloor(p + size);
+        if (end > start) madvise(start, end - start, MADV_HUGEPAGE);
+    }
+
+    // fresh mmap'ed pages are zeros already
+    if ((flags & SMALLOCX_ZERO) && !meta->is_mmap) memset(p, 0, size);
+    if (flags & SMALLOCX_POPULATE) populate(p, size);
+
+    return p;
+}
+
+void sdallocx(void* p, size_t size, int flags) {
+    (void)flags; // nothing to look up here, the header is read to free it anyway
+    sfree_sized(p, size);
+}
+
+void sfree_sized(void* p, size_t size) {
+    if (!p) return;
+
+    // only checked: the header is read to free the block anyway
+    // the caller's size must fit in the block it got
+    assert(align(size) <= ((MallocMetadata*)((char*)p - _size_meta_data()))->size);
+    (void)size;
+
+    sfree(p);
+}
+
+SArena* sarena_create(size_t chunk_size) {
+    if (chunk_size > MAX_ALLOC) return nullptr;
+    if (chunk_size == 0) chunk_size = ARENA_CHUNK_SIZE;
+
+    auto arena = (SArena*) smalloc(sizeof(SArena));
+    if (!arena) return nullptr;
+
+    // chunks are taken lazily, on the first sarena_alloc
+    arena->chunk_size = align(chunk_size);
+    arena->first = nullptr;
+    arena->current = nullptr;
+    arena->bump = nullptr;
+    arena->end = nullptr;
+
+    return arena;
+}
+
+void* sarena_alloc(SArena* arena, size_t size) {
+    // check parameters
+    if (!arena || size == 0 || size > MAX_ALLOC) return nullptr;
+
+    size = align(size);
+
+    // bump, if the current chunk is full move to the next one
+    if ((size_t)(arena->end - arena->bump) < size && !nextArenaChunk(arena, size)) return nullptr;
+
+    void* res = arena->bump;
+    arena->bump += size;
+
+    return res;
+}
+
+void sarena_reset(SArena* arena) {
+    if (!arena || !arena->first) return;
+
+    // every chunk is kept, start bumping from the first one again
+    arena->current = arena->first;
+    arena->bump = (char*)arena->first + sizeof(ArenaChunk);
+    arena->end = arena->bump + arena->first->size;
+}
+
+void sarena_destroy(SArena* arena) {
+    if (!arena) return;
+
+    // every chunk under one lock, objects inside are never visited
+    HeapGuard guard;
+    ArenaChunk* chunk = arena->first;
+    while (chunk) {
+        ArenaChunk* next = chunk->next;
+        untagBlock(chunk);
+        freeBlock(chunk);
+        chunk = next;
+    }
+
+    untagBlock(arena);
+    freeBlock(arena);
+}
+
+void* sreserve(size_t max_size) {
+    size_t page_size = getpagesize();
+    if (max_size == 0 || max_size > ((size_t)-1) / 2) return nullptr;
+    size_t reserved = (max_size + page_size - 1) & ~(page_size - 1);
+
+    HeapGuard guard;
+    if (!withinBudget(_size_meta_data())) return nullptr;
+
+    // a header page, then the buffer: reserved, nothing is committed until sgrow
+    char* base = (char*) mmap(NULL, page_size + reserved, PROT_NONE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) return nullptr; // something went wrong
+    if (mprotect(base, page_size, PROT_READ | PROT_WRITE) != 0) {
+        munmap(base, page_size + reserved);
+        return nullptr;
+    }
+
+    auto meta = (MallocMetadata*)(base + page_size - _size_meta_data());
+    meta->size = 0;
+    meta->is_mmap = true;
+    meta->is_free = false;
+    meta->heap = SLIFETIME_DEFAULT;
+    meta->is_movable = false;
+    meta->is_reserved = true;
+    reservedSize(meta) = reserved;
+    linkMmapped(meta);
+
+    allocated_blocks++;
+    tagBlock(base + page_size);
+
+    return base + page_size;
+}
+
+bool sgrow(void* p, size_t new_size) {
+    if (!p) return false;
+    auto meta = (MallocMetadata*)((char*)p - _size_meta_data());
+
+    HeapGuard guard;
+    if (!meta->is_reserved || new_size > reservedSize(meta)) return false;
+
+    size_t old_size = meta->size;
+    if (!commitReserved(meta, new_size)) return false;
+    retagBlock(meta, meta->tag, old_size);
+    return true;
+}
+
+SAllocResult smalloc_at_least(size_t size) {
+    HeapGuard guard;
+
+    void* p = allocBlock(size);
+    if (!p) return {nullptr, 0};
+
+    auto meta = (MallocMetadata*)((char*)p - _size_meta_data());
+
+    // an mmap'ed block owns the rest of its last page too
+    if (meta->is_mmap) {
+        char* end = pageFloor((char*)p + meta->size + getpagesize() - 1);
+        size_t slack = end - ((char*)p + meta->size);
+        meta->size += slack;
+        allocated_bytes += slack;
+    }
+    tagBlock(p);
+
+    return {p, meta->size};
+}
+
+SAllocResult srealloc_at_least(void* oldp, size_t size) {
+    void* p = srealloc(oldp, size);
+    if (!p) return {nullptr, 0};
+
+    return {p, susable_size(p)};
+}
+
+size_t susable_size(void* p) {
+    if (!p) return 0;
+
+    auto meta = (MallocMetadata*)((char*)p - _size_meta_data());
+    return meta->size;
+}
+
+size_t sgrowth_hint(size_t capacity, size_t needed) {
+    // grow by 1.5, but never less than needed
+    size_t size = capacity + capacity / 2;
+    if (size < needed) size = needed;
+    if (size > MAX_ALLOC) size = needed;
+
+    size = align(size);
+
+    // mmap'ed sizes: fill the last page
+    if (size >= smmap_threshold()) {
+        size_t page_size = getpagesize();
+        size_t total = (_size_meta_data() + size + page_size - 1) & ~(page_size - 1);
+        size = total - _size_meta_data();
+    }
+
+    return size;
+}
+
+size_t spurge(size_t idle_ticks, size_t max_blocks) {
+    if (max_blocks == 0) max_blocks = 1;
+
+    size_t released = 0;
+
+    {
+        HeapGuard guard;
+        purge_clock++;
+        purge_stats.passes++;
+    }
+
+    // walk each free list in address order, at most max_blocks per lock hold
+    for (size_t heap = SLIFETIME_DEFAULT; heap <= NUM_SUB_HEAPS; heap++) {
+        MallocMetadata* resume = nullptr;
+        size_t seen_changes = 0;
+
+        while (true) {
+            HeapGuard guard;
+            purge_stats.lock_holds++;
+
+            MallocMetadata* block = freeListOf(heap)->next_free;
+            if (resume && seen_changes == free_list_changes) {
+                block = resume; // the list didn't change while we slept
+            } else if (resume) {
+                while (block && block < resume) block = block->next_free;
+            }
+
+            for (size_t i = 0; block && i < max_blocks; i++) {
+                size_t purged = purgeBlock(block, idle_ticks);
+                purge_stats.purged_bytes += purged;
+                released += purged;
+                block = block->next_free;
+            }
+
+            if (!block) {
+                if (heap == SLIFETIME_DEFAULT) {
+                    size_t trimmed = trimWilderness(idle_ticks);
+                    purge_stats.trimmed_bytes += trimmed;
+                    released += trimmed;
+                }
+                break;
+            }
+
+            resume = block;
+            seen_changes = free_list_changes;
+        }
+    }
+
+    return released;
+}
+
+void sheap_snapshot_begin(SHeapSnapshot* snapshot) {
+    memset(snapshot, 0, sizeof(SHeapSnapshot));
+}
+
+bool sheap_snapshot_step(SHeapSnapshot* snapshot, size_t max_blocks) {
+    if (snapshot->complete) return true;
+    if (max_blocks == 0) max_blocks = 1;
+
+    HeapGuard guard;
+    if (walkHeap(snapshot->walk, WALK_MMAP, max_blocks, countBlock, snapshot)) return false;
+
+    snapshot->complete = true;
+    if (snapshot->free_bytes) {
+        snapshot->fragmentation = 100 * (snapshot->free_bytes - snapshot->largest_free) / snapshot->free_bytes;
+    }
+    if (wilderness) {
+        snapshot->wilderness_size = wilderness->size;
+        snapshot->wilderness_free = wilderness->is_free;
+    }
+    return true;
+}
+
+SHeapSnapshot sheap_snapshot(size_t max_blocks) {
+    SHeapSnapshot snapshot;
+    sheap_snapshot_begin(&snapshot);
+    while (!sheap_snapshot_step(&snapshot, max_blocks));
+    return snapshot;
+}
+
+bool sheap_write_map(const char* path, size_t max_blocks) {
+    if (max_blocks == 0) max_blocks = 1;
+    if (max_blocks > MAP_BUFFER_RECORDS) max_blocks = MAP_BUFFER_RECORDS;
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+
+    SHeapMapHeader header = {SHEAP_MAP_MAGIC, _size_meta_data(), 0};
+    bool ok = writeAll(fd, &header, sizeof(header));
+
+    MapBuffer buffer;
+    SHeapWalk walk = {};
+    bool more = ok;
+    while (more) {
+        buffer.count = 0;
+        {
+            HeapGuard guard;
+            more = walkHeap(walk, WALK_MMAP, max_blocks, recordBlock, &buffer);
+        }
+
+        header.blocks += buffer.count;
+        if (!writeAll(fd, buffer.records, buffer.count * sizeof(SHeapMapRecord))) ok = more = false;
+    }
+
+    // the block count is known only now
+    if (ok) ok = pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+    return close(fd) == 0 && ok;
+}
+
+bool sprofile_save(const char* path) {
+    SizeProfile profile = {};
+    SHeapWalk walk = {};
+
+    // only the sbrk heap
+    while (true) {
+        HeapGuard guard;
+        if (!walkHeap(walk, SLIFETIME_DEFAULT, PROFILE_MAX_BLOCKS, profileBlock, &profile)) break;
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+
+    ProfileRecord records[PROFILE_BUCKETS];
+    size_t header[2] = {PROFILE_MAGIC, 0};
+    for (size_t bucket = 0; bucket < PROFILE_BUCKETS; bucket++) {
+        if (profile.counts[bucket]) records[header[1]++] = {bucketSize(bucket), profile.counts[bucket]};
+    }
+
+    bool ok = writeAll(fd, header, sizeof(header)) && writeAll(fd, records, header[1] * sizeof(ProfileRecord));
+    return close(fd) == 0 && ok;
+}
+
+bool sprewarm(const char* path, size_t max_bytes, bool background) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+
+    ProfileRecord records[PROFILE_BUCKETS];
+    size_t header[2];
+    bool ok = read(fd, header, sizeof(header)) == sizeof(header) && header[0] == PROFILE_MAGIC && header[1] <= PROFILE_BUCKETS;
+    ok = ok && read(fd, records, header[1] * sizeof(ProfileRecord)) == (ssize_t)(header[1] * sizeof(ProfileRecord));
+    close(fd);
+    if (!ok) return false;
+
+    SizeProfile profile = {};
+    profile.max_bytes = max_bytes;
+    for (size_t i = 0; i < header[1]; i++) {
+        size_t& count = profile.counts[profileBucket(records[i].size)];
+        if (__builtin_add_overflow(count, records[i].count, &count)) count = (size_t)-1;
+    }
+
+    if (!background) return prewarmHeap(profile);
+
+    auto copy = (SizeProfile*) smalloc(sizeof(SizeProfile));
+    if (!copy) return false;
+    *copy = profile;
+
+    pthread_t thread;
+    if (pthread_create(&thread, nullptr, prewarmMain, copy) != 0) {
+        sfree(copy);
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+
+SHandle shandle_alloc(size_t size) {
+    if (size == 0 || size > MAX_ALLOC - sizeof(SHandleEntry*)) return nullptr;
+
+    HeapGuard guard;
+    SHandleEntry* entry = newHandle();
+    if (!entry) return nullptr;
+
+    // the back pointer lets scompact find the handle of a block it moves
+    auto p = (char*) allocBlock(sizeof(SHandleEntry*) + size);
+    if (!p) {
+        entry->next_free = free_handles;
+        free_handles = entry;
+        return nullptr;
+    }
+
+    auto meta = (MallocMetadata*)(p - _size_meta_data());
+    meta->is_movable = !meta->is_mmap; // mmap'ed blocks stay put
+    tagBlock(p);
+
+    *(SHandleEntry**)p = entry;
+    entry->ptr = p + sizeof(SHandleEntry*);
+    entry->locks = 0;
+
+    return entry;
+}
+
+void* shandle_lock(SHandle handle) {
+    if (!handle) return nullptr;
+
+    HeapGuard guard;
+    handle->locks++;
+    return handle->ptr;
+}
+
+void shandle_unlock(SHandle handle) {
+    if (!handle) return;
+
+    HeapGuard guard;
+    assert(handle->locks > 0);
+    handle->locks--;
+}
+
+void shandle_free(SHandle handle) {
+    if (!handle) return;
+
+    HeapGuard guard;
+    assert(handle->locks == 0);
+    untagBlock((char*)handle->ptr - sizeof(SHandleEntry*));
+    freeBlock((char*)handle->ptr - sizeof(SHandleEntry*));
+
+    handle->next_free = free_handles;
+    free_handles = handle;
+}
+
+size_t scompact(size_t max_blocks) {
+    if (max_blocks == 0) max_blocks = 1;
+
+    HeapGuard guard;
+    compact_stats.passes++;
+
+    // resume where the last call stopped, unless blocks were freed or taken meanwhile
+    MallocMetadata* block = heap_head;
+    if (compact_cursor && compact_changes == free_list_changes) block = compact_cursor;
+
+    for (size_t i = 0; block && i < max_blocks; i++) {
+        if (block->is_free && canSlide(block)) block = slideBlock(block);
+        else block = block->heap_next;
+    }
+
+    compact_cursor = block; // nullptr: start over next time
+    compact_changes = free_list_changes;
+
+    // free space that reached the end of the heap goes back to the OS, a trim
+    // changes the free list, so the next call starts over
+    MallocMetadata* trimmed_block = wilderness;
+    size_t trimmed = trimWilderness(0);
+    if (trimmed && compact_cursor == trimmed_block) compact_cursor = nullptr;
+    compact_stats.trimmed_bytes += trimmed;
+
+    return trimmed;
+}
+
+SCompactStats scompact_stats() {
+    HeapGuard guard;
+    return compact_stats;
+}
+
+void smmap_threshold_adapt(const SMmapThresholdConfig* config) {
+    HeapGuard guard;
+
+    if (!config) {
+        threshold_adaptive = false;
+        setThreshold(MMAP_THRESHOLD, 0);
+        return;
+    }
+
+    threshold_adaptive = true;
+    threshold_bounds = *config;
+    if (threshold_bounds.min == 0) threshold_bounds.min = MMAP_THRESHOLD;
+    if (threshold_bounds.max < threshold_bounds.min) threshold_bounds.max = threshold_bounds.min;
+
+    // start inside the new bounds
+    if (mmap_threshold < threshold_bounds.min) setThreshold(threshold_bounds.min, 0);
+    if (mmap_threshold > threshold_bounds.max) setThreshold(threshold_bounds.max, 0);
+}
+
+size_t smmap_threshold() {
+    HeapGuard guard;
+    return mmap_threshold;
+}
+
+size_t smmap_threshold_history(SThresholdChange* changes, size_t max_changes) {
+    HeapGuard guard;
+
+    size_t kept = threshold_changes < THRESHOLD_HISTORY ? threshold_changes : THRESHOLD_HISTORY;
+    size_t count = 0;
+    for (; count < kept && count < max_changes; count++)
+        changes[count] = threshold_history[(threshold_changes - 1 - count) % THRESHOLD_HISTORY];
+
+    return count;
+}
+
+SReallocStats srealloc_stats() {
+    HeapGuard guard;
+
+    SReallocStats stats;
+    stats.in_place = realloc_counts[REALLOC_IN_PLACE];
+    stats.merge_next = realloc_counts[REALLOC_MERGE_NEXT];
+    stats.extend_wilderness = realloc_counts[REALLOC_EXTEND_WILDERNESS];
+    stats.merge_next_wilderness = realloc_counts[REALLOC_MERGE_NEXT_WILDERNESS];
+    stats.merge_prev = realloc_counts[REALLOC_MERGE_PREV];
+    stats.merge_both = realloc_counts[REALLOC_MERGE_BOTH];
+    stats.relocate = realloc_counts[REALLOC_RELOCATE];
+    stats.copied_bytes = realloc_copied_bytes;
+    return stats;
+}
+
+void sbudget_set(const SMemoryBudget* budget) {
+    HeapGuard guard;
+    memory_budget = budget ? *budget : SMemoryBudget{0, 0};
+    reclaim_mark = memory_budget.soft_limit;
+    if (memory_budget.soft_limit && footprint() > memory_budget.soft_limit) over_soft_limit = true;
+}
+
+bool sbudget_add_reclaim(SReclaimCallback callback, void* context) {
+    HeapGuard guard;
+    if (!callback || num_reclaim_callbacks == MAX_RECLAIM_CALLBACKS) return false;
+
+    reclaim_callbacks[num_reclaim_callbacks++] = {callback, context};
+    return true;
+}
+
+void sbudget_remove_reclaim(SReclaimCallback callback, void* context) {
+    HeapGuard guard;
+    for (size_t i = 0; i < num_reclaim_callbacks; i++) {
+        if (reclaim_callbacks[i].callback != callback || reclaim_callbacks[i].context != context) continue;
+
+        // keep the order of the rest
+        memmove(&reclaim_callbacks[i], &reclaim_callbacks[i + 1], (num_reclaim_callbacks - i - 1) * sizeof(ReclaimCallback));
+        num_reclaim_callbacks--;
+        return;
+    }
+}
+
+void sbudget_set_cache_flush(bool (*flush)()) {
+    HeapGuard guard;
+    cache_flush = flush;
+}
+
+SBudgetStats sbudget_stats() {
+    HeapGuard guard;
+    SBudgetStats stats = budget_stats;
+    stats.footprint = footprint();
+    return stats;
+}
+
+void sfree_deferred(void* p) {
+    if (!p) return;
+    auto meta = (MallocMetadata*)((char*)p - _size_meta_data());
+
+    // nowhere to link it (an sreserve buffer with nothing committed)
+    if (meta->size < sizeof(DeferredFree)) {
+        sfree(p);
+        return;
+    }
+
+    // counted before it's pushed, so a drain never takes the counters below 0
+    deferred_bytes.fetch_add(meta->size, std::memory_order_relaxed);
+    bool wake = deferred_blocks.fetch_add(1, std::memory_order_relaxed) + 1 == DRAINER_WAKE_BLOCKS;
+
+    auto node = (DeferredFree*)p;
+    pushDeferred(node, node);
+
+    // without the drainer's lock, at worst the wakeup is missed and it waits its period
+    if (wake) pthread_cond_signal(&drainer_wakeup);
+}
+
+size_t sfree_drain(size_t max_blocks) {
+    return drainDeferred(max_blocks);
+}
+
+bool sdrainer_start(size_t period_ms) {
+    pthread_mutex_lock(&drainer_lock);
+    if (drainer_running) {
+        pthread_mutex_unlock(&drainer_lock);
+        return false;
+    }
+
+    drainer_period_ms = period_ms ? period_ms : DRAINER_PERIOD_MS;
+    drainer_stopping = false;
+    drainer_running = pthread_create(&drainer_thread, nullptr, drainerMain, nullptr) == 0;
+    bool started = drainer_running;
+
+    pthread_mutex_unlock(&drainer_lock);
+    return started;
+}
+
+void sdrainer_stop() {
+    pthread_mutex_lock(&drainer_lock);
+    if (!drainer_running) {
+        pthread_mutex_unlock(&drainer_lock);
+        return;
     }
-    // else, merging was done
 
-    cutAllocatedBlock(merged_block, size); // Try to cut blocks
-    merged_block->is_free = false;  // set merged block as not free
+    drainer_stopping = true;
+    pthread_cond_signal(&drainer_wakeup);
+    pthread_mutex_unlock(&drainer_lock);
+
+    pthread_join(drainer_thread, nullptr);
+
+    pthread_mutex_lock(&drainer_lock);
+    drainer_running = false;
+    pthread_mutex_unlock(&drainer_lock);
+
+    drainDeferred(0);
+}
+
+SDeferredStats sfree_deferred_stats() {
+    SDeferredStats stats;
+    stats.queued_blocks = deferred_blocks.load(std::memory_order_relaxed);
+    stats.queued_bytes = deferred_bytes.load(std::memory_order_relaxed);
+    stats.drained_blocks = drained_blocks.load(std::memory_order_relaxed);
+    return stats;
+}
+
+STag stag_set(STag tag) {
+    STag previous = current_tag;
+    current_tag = tag < STAG_MAX ? tag : STAG_NONE;
+    return previous;
+}
+
+STag stag_current() {
+    return current_tag;
+}
+
+STagStats stag_stats(STag tag) {
+    if (tag >= STAG_MAX) tag = STAG_NONE;
+
+    HeapGuard guard;
+    return tag_stats[tag];
+}
 
-    return (char *)merged_block + _size_meta_data();
+SPurgeStats spurge_stats() {
+    HeapGuard guard;
+    return purge_stats;
 }
 
 size_t _num_free_blocks() {
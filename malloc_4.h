@@ -0,0 +1,549 @@
+#ifndef OS4_MALLOC_4_H
+#define OS4_MALLOC_4_H
+
+#include <stddef.h>
+
+/*---------------ASSIGNMENT FUNCTIONS---------------------------*/
+void* smalloc(size_t size);
+void* scalloc(size_t num, size_t size);
+void sfree(void* p);
+void* srealloc(void* oldp, size_t size);
+size_t _num_free_blocks();
+size_t _num_free_bytes();
+size_t _num_allocated_blocks();
+size_t _num_allocated_bytes();
+size_t _num_meta_data_bytes();
+size_t _size_meta_data();
+
+/*---------------EXTENSIONS-------------------------------------*/
+/**
+ * @param alignment - a power of 2
+ * @return a block whose address is a multiple of alignment, free it with sfree
+ */
+void* smalloc_aligned(size_t alignment, size_t size);
+
+/**
+ * sfree, the size is only checked (an assert) against the block's: freeing reads
+ * the header to coalesce anyway, so knowing the size saves nothing here
+ * @param size - the size p was allocated with (or smaller)
+ */
+void sfree_sized(void* p, size_t size);
+
+/*---------------EXTENDED ALLOCATION---------------------------*/
+// flags of smallocx / smallocx_mt, or'ed together
+#define SMALLOCX_LG_ALIGN_MASK 0x3f
+#define SMALLOCX_LG_ALIGN(lg) ((int)(lg))           // aligned to 2^lg
+#define SMALLOCX_ALIGN(a) ((int)__builtin_ctzl(a))  // a - a power of 2
+#define SMALLOCX_ZERO 0x40
+#define SMALLOCX_POPULATE 0x80      // its pages are faulted in before it's returned
+#define SMALLOCX_HUGEPAGE 0x100     // blocks of 2MB and more are huge page aligned and backed
+#define SMALLOCX_NO_TCACHE 0x200    // smallocx_mt: from the heap, not the thread or cpu caches
+#define SMALLOCX_HEAP_SHIFT 10
+#define SMALLOCX_HEAP(lifetime) ((int)(lifetime) << SMALLOCX_HEAP_SHIFT) // from that sub-heap, no caches
+
+/**
+ * smalloc with flags, free it with sfree or sdallocx
+ * @return nullptr for an unknown heap, or as smalloc
+ */
+void* smallocx(size_t size, int flags);
+
+/**
+ * @param size, flags - what p was allocated with
+ */
+void sdallocx(void* p, size_t size, int flags);
+
+/*---------------USABLE SIZE-----------------------------------*/
+struct SAllocResult {
+    void* ptr;
+    size_t size;    // usable bytes at ptr, >= the requested size
+};
+
+/**
+ * smalloc that also reports the whole capacity of the block
+ * (a block too small to be cut, the rest of an mmap'ed page)
+ */
+SAllocResult smalloc_at_least(size_t size);
+
+/**
+ * srealloc that also reports the capacity of the resulting block
+ */
+SAllocResult srealloc_at_least(void* oldp, size_t size);
+
+/**
+ * @return the bytes usable at p (a block from smalloc / srealloc), 0 for nullptr
+ */
+size_t susable_size(void* p);
+
+/**
+ * @param capacity - the current capacity of a growable buffer
+ * @param needed - the capacity it must reach
+ * @return the size to ask for: geometric growth, rounded so that no slack is lost
+ */
+size_t sgrowth_hint(size_t capacity, size_t needed);
+
+/*---------------RESERVATIONS-----------------------------------*/
+// a buffer that grows in place: its whole range is reserved up front, with no
+// memory behind it, and pages are committed as it grows. growing never copies
+// and isn't capped by smalloc's limit. free it with sfree, susable_size is what's
+// committed, srealloc grows it in place while it fits
+/**
+ * @param max_size - the most it will ever hold
+ * @return a page aligned buffer with nothing committed, nullptr if the range can't be reserved
+ */
+void* sreserve(size_t max_size);
+
+/**
+ * @param p - from sreserve, its bytes stay where they are
+ * @param new_size - at most its max_size, a smaller size than now gives the pages after it back
+ * @return false if new_size doesn't fit the reservation, the pages can't be committed or
+ *         the memory budget is exceeded
+ */
+bool sgrow(void* p, size_t new_size);
+
+/*---------------MMAP THRESHOLD---------------------------------*/
+// blocks of at least the threshold (128KB) are mmap'ed. adaptively, freeing an
+// mmap'ed block raises the threshold above its size, so that size stays on the
+// heap next time; large free blocks piling up in a fragmented heap halve it
+struct SMmapThresholdConfig {
+    size_t min;     // 0 for 128KB
+    size_t max;     // raises beyond it are ignored
+};
+
+struct SThresholdChange {
+    size_t threshold;       // the new value
+    size_t trigger_size;    // the freed block that caused it, 0 for smmap_threshold_adapt
+    bool raised;
+};
+
+/**
+ * @param config - nullptr turns adapting off and restores 128KB
+ */
+void smmap_threshold_adapt(const SMmapThresholdConfig* config);
+size_t smmap_threshold();
+
+/**
+ * @param changes - filled with the most recent changes first (up to 32 are kept)
+ * @return how many were written
+ */
+size_t smmap_threshold_history(SThresholdChange* changes, size_t max_changes);
+
+/*---------------REALLOC STATS---------------------------------*/
+// which strategy served each srealloc (of a non-null block). growing picks the
+// option that copies the fewest bytes, then the one that grows the heap least
+struct SReallocStats {
+    size_t in_place;                // the block was large enough
+    size_t merge_next;              // took the free block after it
+    size_t extend_wilderness;       // the block ends the heap, sbrk'ed the rest
+    size_t merge_next_wilderness;   // took the free wilderness after it, sbrk'ed the rest
+    size_t merge_prev;              // moved down into the free block before it
+    size_t merge_both;
+    size_t relocate;                // a new block, mmap'ed blocks always
+    size_t copied_bytes;            // payload bytes moved by all of the above
+};
+
+SReallocStats srealloc_stats();
+
+/*---------------PURGING---------------------------------------*/
+struct SPurgeStats {
+    size_t passes;          // spurge calls
+    size_t purged_bytes;    // interior pages of free blocks given back with madvise
+    size_t trimmed_bytes;   // wilderness given back with a negative sbrk
+    size_t lock_holds;      // times spurge took the heap lock
+};
+
+/**
+ * gives memory that stayed free for idle_ticks spurge calls back to the OS.
+ * each call is one tick of the idle clock
+ * @param max_blocks - free blocks visited per heap lock hold
+ * @return the bytes given back
+ */
+size_t spurge(size_t idle_ticks, size_t max_blocks);
+
+SPurgeStats spurge_stats();
+
+/*---------------MEMORY BUDGET----------------------------------*/
+// a cap on the footprint: _num_allocated_bytes() + _num_meta_data_bytes() and the
+// free index. once an allocation takes the heap past the soft limit, that thread
+// reclaims before it returns: the free wilderness is trimmed, caches in front of
+// the heap are flushed, free pages are purged, then the registered callbacks run.
+// growing past the hard limit fails, smalloc returns nullptr
+struct SMemoryBudget {
+    size_t soft_limit;  // 0 for none
+    size_t hard_limit;  // 0 for none
+};
+
+struct SBudgetStats {
+    size_t footprint;
+    size_t reclaims;            // times the soft limit was crossed
+    size_t reclaimed_bytes;     // footprint given back by them
+    size_t hard_failures;       // allocations refused
+};
+
+/**
+ * @param excess - the footprint over the soft limit, the callback may sfree
+ */
+typedef void (*SReclaimCallback)(size_t excess, void* context);
+
+/**
+ * @param budget - nullptr removes the limits
+ */
+void sbudget_set(const SMemoryBudget* budget);
+
+/**
+ * callbacks run in the order they were added, until the footprint is under the soft limit
+ * @return false if 16 are registered already
+ */
+bool sbudget_add_reclaim(SReclaimCallback callback, void* context);
+void sbudget_remove_reclaim(SReclaimCallback callback, void* context);
+
+/**
+ * for a cache in front of the heap (malloc_4_mt.cpp registers its page heap)
+ * @param flush - gives unused heap blocks back with sfree, returns false if it
+ *                can't now (the calling thread is inside the cache), it's retried later
+ */
+void sbudget_set_cache_flush(bool (*flush)());
+
+SBudgetStats sbudget_stats();
+
+/*---------------HEAP WALK--------------------------------------*/
+#define SHEAP_SIZE_BUCKETS 32
+
+// where a bounded walk stopped, don't touch
+struct SHeapWalk {
+    size_t part;        // the sbrk heap, then each sub-heap, then the mmap'ed blocks
+    void* last;         // the last block visited
+    void* next;
+    void* segment;
+    size_t free_list_changes;
+    size_t mmap_changes;
+};
+
+// the heap's blocks by size, from one walk. blocks that change while the heap
+// lock is released between steps are seen as they are when reached
+struct SHeapSnapshot {
+    size_t used_blocks;     // mmap'ed ones included
+    size_t used_bytes;
+    size_t free_blocks;
+    size_t free_bytes;
+    size_t mmap_blocks;
+    size_t mmap_bytes;
+    size_t largest_free;
+    size_t fragmentation;   // % of the free bytes outside the largest free block
+    size_t wilderness_size; // the last block of the sbrk heap, 0 if there's none
+    bool wilderness_free;
+    size_t used_sizes[SHEAP_SIZE_BUCKETS]; // [i] counts blocks of [2^i, 2^(i+1)) bytes
+    size_t free_sizes[SHEAP_SIZE_BUCKETS];
+    bool complete;          // the walk reached the last block
+    SHeapWalk walk;
+};
+
+void sheap_snapshot_begin(SHeapSnapshot* snapshot);
+
+/**
+ * walks on from where the last step stopped, under one heap lock hold
+ * @param max_blocks - blocks visited
+ * @return true once the snapshot is complete
+ */
+bool sheap_snapshot_step(SHeapSnapshot* snapshot, size_t max_blocks);
+
+/**
+ * a whole walk, releasing the heap lock every max_blocks blocks
+ */
+SHeapSnapshot sheap_snapshot(size_t max_blocks);
+
+// sheap_write_map writes a header and then a record per block, in walk order
+#define SHEAP_MAP_MAGIC 0x3150414d50414548 // "HEAPMAP1"
+#define SHEAP_MAP_FREE 1
+#define SHEAP_MAP_PART_SHIFT 1  // bits 1-2: 0 the sbrk heap, 1 SLIFETIME_SHORT, 2 SLIFETIME_LONG, 3 mmap'ed
+
+struct SHeapMapHeader {
+    size_t magic;
+    size_t meta_data_size;  // bytes before each block's address
+    size_t blocks;          // records that follow
+};
+
+struct SHeapMapRecord {
+    size_t address;
+    size_t size_flags;      // the size, its low 3 bits are flags (sizes are multiples of 8)
+};
+
+/**
+ * @param path - created or truncated
+ * @param max_blocks - blocks visited per heap lock hold, the file is written without it
+ * @return false if the file can't be written
+ */
+bool sheap_write_map(const char* path, size_t max_blocks);
+
+/*---------------PRE-WARMING------------------------------------*/
+// a profile of the block sizes live on the heap, saved by one run and loaded by
+// the next at startup: the heap is grown by what it held at once and faulted in,
+// so the first smallocs neither sbrk nor fault
+/**
+ * @return false if the file can't be written
+ */
+bool sprofile_save(const char* path);
+
+/**
+ * @param max_bytes - caps how much the heap grows, 0 for the whole profile
+ * @param background - prewarm on a thread of its own, returns once the profile is read
+ * @return false if the profile can't be read, the heap can't grow or the thread can't start
+ */
+bool sprewarm(const char* path, size_t max_bytes, bool background);
+
+/*---------------ALLOCATION TAGS--------------------------------*/
+// which subsystem holds the heap's bytes: a block is charged to the tag its
+// thread had set when it was allocated, until it is freed. srealloc keeps the
+// block's tag. malloc_4_mt.cpp charges its caches and page heap to STAG_NONE
+typedef unsigned short STag;
+
+#define STAG_NONE 0
+#define STAG_MAX 256    // larger tags are charged to STAG_NONE
+
+struct STagStats {
+    size_t live_bytes;
+    size_t live_blocks;
+    size_t allocations;     // since start, sample twice for a rate
+    size_t allocated_bytes; // since start, sreallocs count what they grow by
+    size_t frees;
+};
+
+/**
+ * @return the tag the thread had, to be set back when its scope ends
+ */
+STag stag_set(STag tag);
+STag stag_current();
+
+STagStats stag_stats(STag tag);
+
+// the thread's tag for a scope
+struct STagScope {
+    STag saved;
+
+    explicit STagScope(STag tag) : saved(stag_set(tag)) {}
+    ~STagScope() { stag_set(saved); }
+    STagScope(const STagScope&) = delete;
+    STagScope& operator=(const STagScope&) = delete;
+};
+
+/*---------------DEFERRED FREE----------------------------------*/
+// sfree without the heap lock: the block is pushed on a lock-free queue, and
+// merged into the free list later, in batches, by sfree_drain (at an idle point
+// of the caller's) or by the drainer thread. until then it counts as allocated,
+// in _num_allocated_* and its tag's stats. a reclaim drains the queue first
+struct SDeferredStats {
+    size_t queued_blocks;
+    size_t queued_bytes;
+    size_t drained_blocks;  // since start
+};
+
+void sfree_deferred(void* p);
+
+/**
+ * @param max_blocks - frees at most that many, 0 for the whole queue
+ * @return the blocks freed
+ */
+size_t sfree_drain(size_t max_blocks);
+
+/**
+ * starts a thread that drains the queue every period, or sooner once 256 blocks wait
+ * @param period_ms - 0 for 10ms
+ * @return false if it's already running or the thread can't be created
+ */
+bool sdrainer_start(size_t period_ms);
+
+/**
+ * drains what is left on the queue once the thread is done
+ */
+void sdrainer_stop();
+
+SDeferredStats sfree_deferred_stats();
+
+/*---------------LIFETIME HINTS---------------------------------*/
+enum SLifetime {
+    SLIFETIME_DEFAULT = 0,  // the sbrk heap, like smalloc
+    SLIFETIME_SHORT = 1,    // request buffers, temporaries
+    SLIFETIME_LONG = 2      // caches, objects that live until exit
+};
+
+/**
+ * smalloc from a sub-heap of its own per lifetime, so blocks that die soon don't
+ * pin free space between long lived ones. sub-heaps map 1MB segments and give a
+ * segment back once all of its blocks are freed (the last one is kept).
+ * sfree / srealloc work as usual, srealloc stays in the block's sub-heap
+ */
+void* smalloc_hint(size_t size, SLifetime lifetime);
+
+/*---------------HANDLES----------------------------------------*/
+// blocks the heap may move while they are unlocked, to close the gaps between them
+typedef struct SHandleEntry* SHandle;
+
+/**
+ * @return a handle to size movable bytes, nullptr if the heap is out of memory
+ */
+SHandle shandle_alloc(size_t size);
+
+/**
+ * @return the handle's bytes, they stay put until the matching shandle_unlock.
+ * locks nest. never sfree / srealloc the pointer, use shandle_free
+ */
+void* shandle_lock(SHandle handle);
+void shandle_unlock(SHandle handle);
+
+/**
+ * @param handle - unlocked, invalid afterwards
+ */
+void shandle_free(SHandle handle);
+
+struct SCompactStats {
+    size_t passes;          // scompact calls
+    size_t moved_blocks;
+    size_t moved_bytes;     // headers included
+    size_t trimmed_bytes;   // end of the heap given back with a negative sbrk
+};
+
+/**
+ * one bounded step of compaction: unlocked handle blocks slide down into the free
+ * block before them, so free space moves to the end of the heap and is trimmed.
+ * the next call continues where this one stopped
+ * @param max_blocks - heap blocks visited (each moved at most once)
+ * @return the bytes given back
+ */
+size_t scompact(size_t max_blocks);
+
+SCompactStats scompact_stats();
+
+/*---------------ARENAS-----------------------------------------*/
+// objects that die together: bump allocated, released all at once
+struct SArena;
+
+/**
+ * @param chunk_size - bytes taken from the heap per chunk, 0 for the default (64KB)
+ */
+SArena* sarena_create(size_t chunk_size);
+
+/**
+ * @return 8 aligned memory that lives until sarena_reset / sarena_destroy
+ */
+void* sarena_alloc(SArena* arena, size_t size);
+
+/**
+ * frees every object of the arena in O(1), the chunks are kept for reuse
+ */
+void sarena_reset(SArena* arena);
+
+/**
+ * gives every chunk back to the heap
+ */
+void sarena_destroy(SArena* arena);
+
+/*---------------THREAD CACHES (malloc_4_mt.cpp)----------------*/
+// small sizes are served from per-cpu caches (rseq) or, without rseq, from
+// per-thread caches; sizes below 128KB get whole pages from a shared page heap,
+// larger ones go to smalloc. any thread may free any block,
+// frees of another thread's objects are queued to that thread and picked up
+// on its next smalloc_mt
+void* smalloc_mt(size_t size);
+void* scalloc_mt(size_t num, size_t size);
+void sfree_mt(void* p);
+void* srealloc_mt(void* oldp, size_t size);
+
+/**
+ * smallocx through the caches, free it with sfree_mt or sdallocx_mt
+ */
+void* smallocx_mt(size_t size, int flags);
+
+/**
+ * @param size, flags - what p was allocated with. with per-cpu caches the size
+ *                      tells a small object's class, its page isn't looked up
+ */
+void sdallocx_mt(void* p, size_t size, int flags);
+
+/**
+ * @return true if this thread allocates from per-cpu caches
+ */
+bool smalloc_percpu_enabled();
+
+struct SScavengerConfig {
+    size_t period_ms;   // between passes
+    size_t idle_ms;     // memory free for this long goes back to the OS
+    size_t max_blocks;  // free blocks visited per heap lock hold
+};
+
+/**
+ * starts a background thread that, every period, empties the caches of exited
+ * threads, purges idle free pages of the page heap and calls spurge.
+ * results are in spurge_stats() and _num_purged_span_bytes()
+ * @param config - nullptr for the defaults (1s period, 10s idle, 64 blocks)
+ * @return false if it's already running or the thread can't be created
+ */
+bool sscavenger_start(const SScavengerConfig* config);
+void sscavenger_stop();
+
+/**
+ * @return objects moved out of exited threads' caches by the scavenger
+ */
+size_t _num_scavenged_objects();
+
+/**
+ * @return bytes of free page heap spans given back to the OS by the scavenger
+ */
+size_t _num_purged_span_bytes();
+
+/*---------------PERSISTENT HEAPS (malloc_4_persistent.cpp)-----*/
+// a heap inside a file or a shm object, mapped shared: other processes (or this
+// one after a restart) attach to it and see the same blocks. the mapping may sit
+// at another address in each process, so store offsets (spheap_to_offset) in the
+// heap, not pointers. the heap doesn't grow past the size it was created with
+struct SPHeap;
+
+enum SPHeapKind {
+    SPHEAP_FILE,    // name is a path
+    SPHEAP_SHM      // name is a shm_open name, "/name"
+};
+
+/**
+ * creates the heap, or attaches to it if it exists. a backing object whose creator
+ * died before setting the heap up is removed and created again
+ * @param size - capacity of a new heap (at least 64KB), ignored when attaching
+ * @return nullptr if it can't be opened or isn't a heap of this version
+ */
+SPHeap* spheap_open(const char* name, SPHeapKind kind, size_t size);
+
+/**
+ * unmaps the heap from this process, its blocks stay
+ */
+void spheap_close(SPHeap* heap);
+
+/**
+ * deletes the backing file / shm object, mappings stay valid until closed
+ */
+bool spheap_remove(const char* name, SPHeapKind kind);
+
+void* spheap_alloc(SPHeap* heap, size_t size);
+void spheap_free(SPHeap* heap, void* p);
+void* spheap_realloc(SPHeap* heap, void* oldp, size_t size);
+
+/**
+ * @return p relative to the start of the heap, 0 for nullptr
+ */
+size_t spheap_to_offset(SPHeap* heap, void* p);
+void* spheap_from_offset(SPHeap* heap, size_t offset);
+
+/**
+ * @param root - a block of the heap, where an attaching process starts from
+ */
+void spheap_set_root(SPHeap* heap, void* root);
+void* spheap_root(SPHeap* heap);
+
+struct SPHeapStats {
+    size_t capacity;
+    size_t free_blocks;
+    size_t free_bytes;
+    size_t allocated_blocks;
+    size_t allocated_bytes;
+    size_t repairs;         // times a process died holding the heap lock and the heap was rebuilt
+};
+
+SPHeapStats spheap_stats(SPHeap* heap);
+
+#endif //OS4_MALLOC_4_H
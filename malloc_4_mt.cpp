@@ -0,0 +1,1140 @@
+#include <unistd.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/sysinfo.h>
+#include <time.h>
+#include <sys/rseq.h>
+#include <atomic>
+#include <new>
+#include "malloc_4.h"
+#include "size_classes.h" // NUM_CLASSES, size_classes (gen_size_classes.cpp)
+
+#if defined(__SANITIZE_THREAD__)
+// objects pass between threads through the per-cpu caches with plain stores in a
+// restartable sequence, ThreadSanitizer only sees the order through these
+extern "C" void __tsan_acquire(void* addr);
+extern "C" void __tsan_release(void* addr);
+#define TSAN_RELEASE(addr) __tsan_release(addr)
+#define TSAN_ACQUIRE(addr) __tsan_acquire(addr)
+#else
+#define TSAN_RELEASE(addr) ((void)0)
+#define TSAN_ACQUIRE(addr) ((void)0)
+#endif
+
+/*---------------DECLARATIONS-----------------------------------*/
+#define PAGE_SHIFT 12
+#define SPAN_PAGE ((size_t)1 << PAGE_SHIFT)
+#define SLAB_PAGES 16           // = 64KB per slab
+#define REGION_PAGES 256        // = 1MB, what the page heap takes from the heap at once
+#define SPANS_PER_CHUNK 64      // span descriptors allocated at once
+#define SMALL_MAX 1024          // larger sizes get their own span
+#define MMAP_THRESHOLD 131072   // = 128*1024, like malloc_4.cpp: larger sizes go straight to the heap
+#define CPU_CACHE_SIZE 32       // objects per class per cpu
+#define MIN_BATCH 8             // objects a thread cache moves at once, grows with use
+#define MAX_BATCH 128
+#define MAX_BATCH_BYTES 16384   // = 16*1024, caps the batch of large classes
+#define TRANSFER_SLOTS 64       // batches a transfer cache holds per class
+
+#define SCAVENGER_PERIOD_MS 1000
+#define SCAVENGER_IDLE_MS 10000
+#define SCAVENGER_MAX_BLOCKS 64
+#define TAG_SHIFT 48            // pointers use the low 48 bits, the rest is an ABA tag
+
+#define PAGEMAP_LEAF_BITS 18
+#define PAGEMAP_ROOT_BITS (48 - PAGE_SHIFT - PAGEMAP_LEAF_BITS) // 48 bit user addresses
+
+static_assert(NUM_CLASSES <= 255, "a class index is an unsigned char");
+static_assert(size_classes[NUM_CLASSES - 1] == SMALL_MAX, "the last class must hold every small size");
+
+// size -> class, indexed by (size + 15) / 16
+struct ClassIndex {
+    unsigned char index[SMALL_MAX / 16 + 1];
+
+    constexpr ClassIndex() : index() {
+        size_t cls = 0;
+        for (size_t i = 0; i <= SMALL_MAX / 16; i++) {
+            while (size_classes[cls] < i * 16) cls++;
+            index[i] = cls;
+        }
+    }
+};
+constexpr ClassIndex class_index;
+
+struct FreeObject {
+    FreeObject* next;
+};
+
+struct FreeList {
+    FreeObject* head;
+    size_t count;
+    size_t batch;   // objects moved per refill / flush, the list holds up to 2 * batch
+};
+
+// a list of objects that moves between caches as a whole
+struct Batch {
+    FreeObject* head;
+    FreeObject* tail;
+    size_t count;
+};
+
+struct ThreadCache {
+    FreeList lists[NUM_CLASSES];
+
+    // objects of our slabs freed by other threads (many producers, we consume)
+    std::atomic<FreeObject*> remote_free;
+
+    ThreadCache* next_orphan; // while no thread owns this cache
+};
+
+#define SPAN_MEDIUM NUM_CLASSES // size_class of a span handed to a caller as one block
+
+// a run of pages: a slab (every object has the same size class and owner),
+// a medium block, or free in the page heap
+struct Span {
+    size_t start;           // first page number
+    size_t pages;
+    ThreadCache* owner;     // slabs: nullptr feeds the per-cpu caches
+    size_t size_class;
+    bool is_free;
+    bool is_purged;         // free and given back with madvise
+    size_t freed_at;        // page heap clock
+    Span* next_free;        // free spans of the same length, or spare descriptors
+    Span* prev_free;
+};
+
+// page -> span, a leaf is mapped when a span first lands in its range.
+// every page of a span in use is mapped, of a free span only the first and the last
+std::atomic<Span**> pagemap[1 << PAGEMAP_ROOT_BITS];
+
+// free spans by length, a span never outgrows the region it was cut from
+Span* free_spans[REGION_PAGES + 1];
+Span* spare_spans = nullptr;
+size_t page_heap_clock = 0;     // scavenger passes
+size_t span_purged_bytes = 0;
+pthread_mutex_t page_heap_lock = PTHREAD_MUTEX_INITIALIZER;
+thread_local bool in_page_heap = false; // this thread calls the heap with page_heap_lock held
+
+// caches of exited threads, adopted by new threads
+ThreadCache* orphans = nullptr;
+pthread_mutex_t orphans_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void orphanCache(ThreadCache* cache);
+
+struct CacheHolder {
+    ThreadCache* cache = nullptr;
+
+    ~CacheHolder() {
+        if (cache) orphanCache(cache);
+        cache = nullptr;
+    }
+};
+thread_local CacheHolder holder;
+
+// a stack of free objects, only touched inside rseq critical sections of its cpu
+struct CpuClassCache {
+    size_t count;
+    void* items[CPU_CACHE_SIZE];
+};
+
+struct alignas(64) CpuCache {
+    CpuClassCache classes[NUM_CLASSES];
+};
+
+// a lock-free stack (Treiber) of free objects, feeds and drains every cache of its class
+struct alignas(64) CentralList {
+    std::atomic<size_t> head; // tagged pointer, see TAG_SHIFT
+};
+
+CpuCache* cpu_caches = nullptr; // nullptr: no rseq, threads use their own caches
+size_t num_cpus = 0;
+pthread_once_t cpu_caches_once = PTHREAD_ONCE_INIT;
+
+CentralList central[NUM_CLASSES];
+
+// whole batches in front of the central lists: one short lock per batch instead of a CAS per object
+struct alignas(64) TransferCache {
+    std::atomic_flag lock;
+    size_t used;
+    Batch batches[TRANSFER_SLOTS];
+};
+
+TransferCache transfer[NUM_CLASSES];
+
+pthread_t scavenger_thread;
+bool scavenger_running = false;     // guarded by scavenger_lock, like the rest
+bool scavenger_stopping = false;
+SScavengerConfig scavenger_config;
+pthread_mutex_t scavenger_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t scavenger_wakeup = PTHREAD_COND_INITIALIZER;
+std::atomic<size_t> scavenged_objects(0);
+
+/*---------------HELPER FUNCTIONS---------------------------*/
+size_t sizeClass(size_t size) {
+    return class_index.index[(size + 15) / 16];
+}
+
+Span* pagemapGet(void* p) {
+    size_t page = (size_t)p >> PAGE_SHIFT;
+    size_t root = page >> PAGEMAP_LEAF_BITS;
+    if (root >= (1 << PAGEMAP_ROOT_BITS)) return nullptr;
+
+    Span** leaf = pagemap[root].load(std::memory_order_acquire);
+    if (!leaf) return nullptr;
+
+    return leaf[page & ((1 << PAGEMAP_LEAF_BITS) - 1)];
+}
+
+Span** pagemapLeaf(size_t root) {
+    Span** leaf = pagemap[root].load(std::memory_order_acquire);
+    if (leaf) return leaf;
+
+    // lazily backed: only touched entries cost memory
+    size_t leaf_size = sizeof(Span*) << PAGEMAP_LEAF_BITS;
+    void* mem = mmap(NULL, leaf_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) return nullptr;
+
+    if (pagemap[root].compare_exchange_strong(leaf, (Span**)mem, std::memory_order_acq_rel)) return (Span**)mem;
+
+    // another thread was first
+    munmap(mem, leaf_size);
+    return leaf;
+}
+
+/**
+ * @param span - registered for every page in [first, last]
+ */
+bool pagemapSet(size_t first, size_t last, Span* span) {
+    for (size_t page = first; page <= last; page++) {
+        Span** leaf = pagemapLeaf(page >> PAGEMAP_LEAF_BITS);
+        if (!leaf) return false;
+
+        leaf[page & ((1 << PAGEMAP_LEAF_BITS) - 1)] = span;
+    }
+
+    return true;
+}
+
+ThreadCache* localCache() {
+    if (holder.cache) return holder.cache;
+
+    // adopt the cache of an exited thread, with its slabs and free objects
+    pthread_mutex_lock(&orphans_lock);
+    ThreadCache* cache = orphans;
+    if (cache) orphans = cache->next_orphan;
+    pthread_mutex_unlock(&orphans_lock);
+
+    if (!cache) {
+        STagScope untagged(STAG_NONE); // caches are shared by every tag
+        void* mem = smalloc_aligned(64, sizeof(ThreadCache));
+        if (!mem) return nullptr;
+        cache = new (mem) ThreadCache();
+    }
+
+    holder.cache = cache;
+    return cache;
+}
+
+/**
+ * @param cache - the cache of an exiting thread
+ * other threads may still free into its remote queue, so it's kept for the next thread
+ */
+void orphanCache(ThreadCache* cache) {
+    pthread_mutex_lock(&orphans_lock);
+    cache->next_orphan = orphans;
+    orphans = cache;
+    pthread_mutex_unlock(&orphans_lock);
+}
+
+void pushObject(FreeList& list, FreeObject* obj) {
+    obj->next = list.head;
+    list.head = obj;
+    list.count++;
+}
+
+/**
+ * @param owner - the cache that owns obj's slab, not the calling thread's
+ */
+void pushRemote(ThreadCache* owner, FreeObject* obj) {
+    FreeObject* head = owner->remote_free.load(std::memory_order_relaxed);
+    do {
+        obj->next = head;
+    } while (!owner->remote_free.compare_exchange_weak(head, obj, std::memory_order_release, std::memory_order_relaxed));
+}
+
+void flushCache(FreeList& list, size_t size_class);
+
+/**
+ * @param obj - a free object of size_class, may trigger a flush to the central list
+ */
+void cachePush(ThreadCache* cache, size_t size_class, FreeObject* obj) {
+    FreeList& list = cache->lists[size_class];
+
+    pushObject(list, obj);
+    if (list.count > 2 * list.batch) flushCache(list, size_class);
+}
+
+/**
+ * takes the whole remote queue at once and sorts it into the local lists
+ */
+void drainRemote(ThreadCache* cache) {
+    FreeObject* obj = cache->remote_free.exchange(nullptr, std::memory_order_acquire);
+
+    while (obj) {
+        FreeObject* next = obj->next;
+        cachePush(cache, pagemapGet(obj)->size_class, obj);
+        obj = next;
+    }
+}
+
+/**
+ * @return the size smallocx_mt takes from the caches for size and flags, 0 if they go to the heap
+ */
+size_t cachedSize(size_t size, int flags) {
+    if (size == 0 || size >= MMAP_THRESHOLD) return 0;
+    if (flags & (SMALLOCX_NO_TCACHE | SMALLOCX_HEAP(3))) return 0;
+
+    // objects are 16 aligned, medium spans page aligned
+    size_t alignment = (size_t)1 << (flags & SMALLOCX_LG_ALIGN_MASK);
+    if (alignment <= 16) return size;
+    if (alignment > SPAN_PAGE) return 0;
+
+    // a slab's objects sit at multiples of their class size from its first page
+    size_t rounded = (size + alignment - 1) & ~(alignment - 1);
+    if (rounded <= SMALL_MAX && size_classes[sizeClass(rounded)] % alignment != 0) return 0;
+    return rounded;
+}
+
+/**
+ * faults in the pages of [p, p + size) now instead of on first touch, keeping their bytes
+ */
+void prefault(char* p, size_t size) {
+    for (volatile char* q = p; q < p + size; q += SPAN_PAGE) *q = *q;
+    volatile char* last = p + size - 1;
+    *last = *last;
+}
+
+/*---------------PAGE HEAP----------------------------------*/
+char* spanAddress(Span* span) {
+    return (char*)(span->start << PAGE_SHIFT);
+}
+
+/**
+ * @return an unused span descriptor (page_heap_lock held)
+ */
+Span* newSpan() {
+    if (!spare_spans) {
+        STagScope untagged(STAG_NONE);
+        in_page_heap = true;
+        auto chunk = (Span*)smalloc(SPANS_PER_CHUNK * sizeof(Span));
+        in_page_heap = false;
+        if (!chunk) return nullptr;
+
+        for (size_t i = 0; i < SPANS_PER_CHUNK; i++) {
+            chunk[i].next_free = spare_spans;
+            spare_spans = &chunk[i];
+        }
+    }
+
+    Span* span = spare_spans;
+    spare_spans = span->next_free;
+    *span = Span();
+    return span;
+}
+
+void deleteSpan(Span* span) {
+    span->next_free = spare_spans;
+    spare_spans = span;
+}
+
+void addFreeSpan(Span* span) {
+    span->is_free = true;
+    span->owner = nullptr;
+    span->prev_free = nullptr;
+    span->next_free = free_spans[span->pages];
+    if (span->next_free) span->next_free->prev_free = span;
+    free_spans[span->pages] = span;
+
+    // enough for the neighbours to find it, the leaves are mapped since growPageHeap
+    size_t last = span->start + span->pages - 1;
+    pagemapSet(span->start, span->start, span);
+    pagemapSet(last, last, span);
+}
+
+void removeFreeSpan(Span* span) {
+    if (span->prev_free) span->prev_free->next_free = span->next_free;
+    else free_spans[span->pages] = span->next_free;
+    if (span->next_free) span->next_free->prev_free = span->prev_free;
+
+    span->is_free = false;
+}
+
+bool flushForBudget();
+
+pthread_once_t budget_flush_once = PTHREAD_ONCE_INIT;
+
+void registerBudgetFlush() {
+    sbudget_set_cache_flush(flushForBudget);
+}
+
+/**
+ * takes a region from the heap as one free span (page_heap_lock held)
+ */
+bool growPageHeap() {
+    Span* span = newSpan();
+    if (!span) return false;
+
+    // a region holds objects of every tag
+    STagScope untagged(STAG_NONE);
+    in_page_heap = true;
+    void* mem = smalloc_aligned(SPAN_PAGE, REGION_PAGES * SPAN_PAGE);
+    in_page_heap = false;
+    if (!mem) {
+        deleteSpan(span);
+        return false;
+    }
+    assert(((size_t)mem >> TAG_SHIFT) == 0);
+
+    span->start = (size_t)mem >> PAGE_SHIFT;
+    span->pages = REGION_PAGES;
+
+    // maps every leaf the region needs, later updates can't fail
+    if (!pagemapSet(span->start, span->start + REGION_PAGES - 1, nullptr)) {
+        sfree(mem);
+        deleteSpan(span);
+        return false;
+    }
+
+    // fresh pages aren't backed yet, nothing to purge
+    span->is_purged = true;
+    span->freed_at = page_heap_clock;
+    addFreeSpan(span);
+    return true;
+}
+
+/**
+ * @param pages - at most REGION_PAGES
+ * @param size_class - SPAN_MEDIUM for a block handed to a caller
+ * @param owner - where frees of a slab's objects go
+ * @return a span in use, with every page mapped to it. nullptr if the heap is out of memory
+ */
+Span* spanAlloc(size_t pages, size_t size_class, ThreadCache* owner) {
+    assert(pages > 0 && pages <= REGION_PAGES);
+    pthread_once(&budget_flush_once, registerBudgetFlush); // before the page heap takes any memory
+    pthread_mutex_lock(&page_heap_lock);
+
+    // the shortest free span that fits
+    size_t length = pages;
+    while (length <= REGION_PAGES && !free_spans[length]) length++;
+    if (length > REGION_PAGES) {
+        if (!growPageHeap()) {
+            pthread_mutex_unlock(&page_heap_lock);
+            return nullptr;
+        }
+        length = REGION_PAGES;
+    }
+
+    Span* span = free_spans[length];
+    removeFreeSpan(span);
+
+    // the rest stays free, without a descriptor for it the caller gets the whole span
+    Span* rest = length > pages ? newSpan() : nullptr;
+    if (rest) {
+        rest->start = span->start + pages;
+        rest->pages = length - pages;
+        rest->is_purged = span->is_purged;
+        rest->freed_at = span->freed_at;
+        span->pages = pages;
+        addFreeSpan(rest);
+    }
+
+    span->is_purged = false;
+    span->owner = owner;
+    span->size_class = size_class;
+    pagemapSet(span->start, span->start + span->pages - 1, span);
+
+    pthread_mutex_unlock(&page_heap_lock);
+    return span;
+}
+
+/**
+ * @param span - a medium block, merged with its free neighbours
+ */
+void spanFree(Span* span) {
+    pthread_mutex_lock(&page_heap_lock);
+
+    Span* prev = pagemapGet(spanAddress(span) - SPAN_PAGE);
+    if (prev && prev->is_free && prev->start + prev->pages == span->start) {
+        removeFreeSpan(prev);
+        span->start = prev->start;
+        span->pages += prev->pages;
+        deleteSpan(prev);
+    }
+
+    Span* next = pagemapGet(spanAddress(span) + (span->pages << PAGE_SHIFT));
+    if (next && next->is_free && next->start == span->start + span->pages) {
+        removeFreeSpan(next);
+        span->pages += next->pages;
+        deleteSpan(next);
+    }
+
+    // some pages are backed again, madvise of the others is harmless
+    span->is_purged = false;
+    span->freed_at = page_heap_clock;
+    addFreeSpan(span);
+
+    pthread_mutex_unlock(&page_heap_lock);
+}
+
+/**
+ * one tick of the page heap clock: gives spans free for idle_ticks ticks back to the OS
+ * @return the bytes given back
+ */
+size_t spanPurge(size_t idle_ticks) {
+    pthread_mutex_lock(&page_heap_lock);
+    page_heap_clock++;
+
+    size_t purged = 0;
+    for (size_t pages = 1; pages <= REGION_PAGES; pages++) {
+        for (Span* span = free_spans[pages]; span; span = span->next_free) {
+            if (span->is_purged || page_heap_clock - span->freed_at < idle_ticks) continue;
+
+            madvise(spanAddress(span), pages << PAGE_SHIFT, MADV_DONTNEED);
+            span->is_purged = true;
+            purged += pages << PAGE_SHIFT;
+        }
+    }
+    span_purged_bytes += purged;
+
+    pthread_mutex_unlock(&page_heap_lock);
+    return purged;
+}
+
+/**
+ * gives regions with no span in use back to the heap
+ * @return the bytes given back
+ */
+size_t releaseFreeRegions() {
+    pthread_mutex_lock(&page_heap_lock);
+    in_page_heap = true;
+
+    // spans never outgrow their region, a free span this long is a whole one
+    size_t released = 0;
+    while (Span* span = free_spans[REGION_PAGES]) {
+        removeFreeSpan(span);
+        pagemapSet(span->start, span->start + REGION_PAGES - 1, nullptr);
+        sfree(spanAddress(span));
+        deleteSpan(span);
+        released += REGION_PAGES << PAGE_SHIFT;
+    }
+
+    in_page_heap = false;
+    pthread_mutex_unlock(&page_heap_lock);
+    return released;
+}
+
+/*---------------CENTRAL FREE LISTS-------------------------*/
+FreeObject* untag(size_t head) {
+    return (FreeObject*)(head & (((size_t)1 << TAG_SHIFT) - 1));
+}
+
+size_t retag(FreeObject* obj, size_t old_head) {
+    size_t tag = (old_head >> TAG_SHIFT) + 1;
+    return (size_t)obj | (tag << TAG_SHIFT);
+}
+
+/**
+ * @param head - a list of objects of size_class ending at tail, pushed with one CAS
+ */
+void centralPush(size_t size_class, FreeObject* head, FreeObject* tail) {
+    std::atomic<size_t>& top = central[size_class].head;
+
+    size_t old = top.load(std::memory_order_relaxed);
+    do {
+        tail->next = untag(old);
+    } while (!top.compare_exchange_weak(old, retag(head, old), std::memory_order_release, std::memory_order_relaxed));
+}
+
+FreeObject* centralPop(size_t size_class) {
+    std::atomic<size_t>& top = central[size_class].head;
+
+    size_t old = top.load(std::memory_order_acquire);
+    while (true) {
+        FreeObject* obj = untag(old);
+        if (!obj) return nullptr;
+
+        // obj may be popped and reused meanwhile: next is then stale, but the
+        // tag changed and the CAS fails (slab memory is never unmapped)
+        FreeObject* next = __atomic_load_n(&obj->next, __ATOMIC_RELAXED);
+        if (top.compare_exchange_weak(old, retag(next, old), std::memory_order_acquire, std::memory_order_acquire))
+            return obj;
+    }
+}
+
+/**
+ * carves a new slab of size_class into the central list
+ * @param owner - where frees of its objects go, nullptr for the per-cpu caches
+ */
+bool carveSlab(size_t size_class, ThreadCache* owner) {
+    Span* slab = spanAlloc(SLAB_PAGES, size_class, owner);
+    if (!slab) return false;
+
+    // link the objects in address order, then publish them at once
+    size_t object_size = size_classes[size_class];
+    auto head = (FreeObject*)spanAddress(slab);
+    FreeObject* tail = head;
+    char* end = spanAddress(slab) + (slab->pages << PAGE_SHIFT);
+    for (char* obj = (char*)head + object_size; obj + object_size <= end; obj += object_size) {
+        tail->next = (FreeObject*)obj;
+        tail = tail->next;
+    }
+
+    centralPush(size_class, head, tail);
+    return true;
+}
+
+/*---------------TRANSFER CACHE-----------------------------*/
+struct TransferGuard {
+    std::atomic_flag& lock;
+
+    TransferGuard(std::atomic_flag& flag) : lock(flag) {
+        while (lock.test_and_set(std::memory_order_acquire)) {}
+    }
+    ~TransferGuard() { lock.clear(std::memory_order_release); }
+};
+
+/**
+ * @param batch - a list of objects of size_class, the central list takes it if we are full
+ */
+void transferPush(size_t size_class, Batch batch) {
+    TransferCache& cache = transfer[size_class];
+    {
+        TransferGuard guard(cache.lock);
+        if (cache.used < TRANSFER_SLOTS) {
+            cache.batches[cache.used++] = batch;
+            return;
+        }
+    }
+
+    centralPush(size_class, batch.head, batch.tail);
+}
+
+/**
+ * @param want - objects to take from the central list when no whole batch is cached
+ * @return a batch of size_class, count is 0 if the heap is out of memory
+ */
+Batch transferPop(size_t size_class, size_t want, ThreadCache* owner) {
+    TransferCache& cache = transfer[size_class];
+    {
+        TransferGuard guard(cache.lock);
+        if (cache.used > 0) return cache.batches[--cache.used];
+    }
+
+    Batch batch = {nullptr, nullptr, 0};
+    while (batch.count < want) {
+        FreeObject* obj = centralPop(size_class);
+        if (!obj) {
+            // the heap lock is only taken here, once per slab
+            if (batch.count > 0 || !carveSlab(size_class, owner)) break;
+            continue;
+        }
+
+        obj->next = batch.head;
+        batch.head = obj;
+        if (!batch.tail) batch.tail = obj;
+        batch.count++;
+    }
+
+    return batch;
+}
+
+/**
+ * @return how many objects of size_class may move at once
+ */
+size_t maxBatch(size_t size_class) {
+    size_t batch = MAX_BATCH_BYTES / size_classes[size_class];
+    if (batch < MIN_BATCH) return MIN_BATCH;
+    if (batch > MAX_BATCH) return MAX_BATCH;
+    return batch;
+}
+
+/**
+ * every refill and flush means the class is busy: move more objects next time
+ */
+void growBatch(FreeList& list, size_t size_class) {
+    if (list.batch < MIN_BATCH) {
+        list.batch = MIN_BATCH;
+        return;
+    }
+
+    list.batch *= 2;
+    if (list.batch > maxBatch(size_class)) list.batch = maxBatch(size_class);
+}
+
+/**
+ * @param list - a thread cache list over 2 * batch, keeps its most recent objects
+ */
+void flushCache(FreeList& list, size_t size_class) {
+    // a cache that never moved a batch of this class (or was flushed as an orphan)
+    if (list.batch == 0 || list.count <= list.batch) {
+        growBatch(list, size_class);
+        return;
+    }
+    size_t count = list.batch;
+
+    FreeObject* last_kept = list.head;
+    for (size_t i = 1; i < list.count - count; i++) last_kept = last_kept->next;
+
+    Batch batch = {last_kept->next, last_kept->next, count};
+    for (size_t i = 1; i < count; i++) batch.tail = batch.tail->next;
+
+    last_kept->next = batch.tail->next;
+    batch.tail->next = nullptr;
+    list.count -= count;
+
+    transferPush(size_class, batch);
+    growBatch(list, size_class);
+}
+
+/**
+ * the thread cache of size_class is empty: take a batch
+ */
+bool refill(ThreadCache* cache, size_t size_class) {
+    FreeList& list = cache->lists[size_class];
+    growBatch(list, size_class);
+
+    Batch batch = transferPop(size_class, list.batch, cache);
+    if (batch.count == 0) return false;
+
+    batch.tail->next = list.head;
+    list.head = batch.head;
+    list.count += batch.count;
+
+    return true;
+}
+
+/*---------------PER-CPU CACHES-----------------------------*/
+/**
+ * per-cpu caches need the rseq area glibc registers for every thread
+ */
+void initCpuCaches() {
+#if defined(__x86_64__)
+    if (__rseq_size < offsetof(struct rseq, rseq_cs) + sizeof(uint64_t)) return;
+
+    size_t cpus = get_nprocs_conf();
+    void* mem = mmap(NULL, cpus * sizeof(CpuCache), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (mem == MAP_FAILED) return;
+
+    num_cpus = cpus;
+    cpu_caches = (CpuCache*)mem;
+#endif
+}
+
+/**
+ * @return the rseq area of this thread, or nullptr if per-cpu caches can't be used
+ */
+struct rseq* cpuCacheArea() {
+    pthread_once(&cpu_caches_once, initCpuCaches);
+    if (!cpu_caches) return nullptr;
+
+    auto rs = (struct rseq*)((char*)__builtin_thread_pointer() + __rseq_offset);
+
+    // registration of this thread failed
+    if (rs->cpu_id >= num_cpus) return nullptr;
+
+    return rs;
+}
+
+#if defined(__x86_64__)
+/*
+ * The kernel restarts a sequence at its abort label (preceded by RSEQ_SIG) if
+ * the thread is preempted, migrated or signaled between labels 1 and 2, so the
+ * single store at label 2 publishes the change on the cpu we read at label 1.
+ */
+#define RSEQ_CS_ENTER                                                   \
+    ".pushsection __rseq_cs, \"aw\"\n\t"                                \
+    ".balign 32\n\t"                                                    \
+    "3:\n\t"                                                            \
+    ".long 0x0, 0x0\n\t"                                                \
+    ".quad 1f, 2f - 1f, 4f\n\t"                                          \
+    ".popsection\n\t"                                                   \
+    "0:\n\t"                                                            \
+    "leaq 3b(%%rip), %%rax\n\t"                                          \
+    "movq %%rax, %[rseq_cs]\n\t"                                         \
+    "1:\n\t"                                                            \
+    "movl %[cpu_id], %%eax\n\t"                                          \
+    "imulq %[stride], %%rax\n\t"                                         \
+    "addq %[base], %%rax\n\t"
+
+#define RSEQ_CS_ABORT                                                   \
+    ".pushsection __rseq_failure, \"ax\"\n\t"                           \
+    ".byte 0x0f, 0xb9, 0x3d\n\t"                                        \
+    ".long 0x53053053\n\t"                                              \
+    "4:\n\t"                                                            \
+    "jmp 0b\n\t"                                                        \
+    ".popsection\n\t"
+
+/**
+ * @return an object from this cpu's cache of size_class, nullptr if empty
+ */
+void* cpuPop(struct rseq* rs, size_t size_class) {
+    void* obj;
+    char* base = (char*)&cpu_caches[0].classes[size_class];
+
+    asm volatile(
+        RSEQ_CS_ENTER
+        "movq (%%rax), %%rcx\n\t"             // count
+        "testq %%rcx, %%rcx\n\t"
+        "jz 5f\n\t"
+        "movq (%%rax, %%rcx, 8), %[obj]\n\t"   // items[count - 1]
+        "decq %%rcx\n\t"
+        "movq %%rcx, (%%rax)\n\t"             // commit
+        "2:\n\t"
+        "jmp 6f\n\t"
+        "5:\n\t"
+        "xorl %k[obj], %k[obj]\n\t"
+        "6:\n\t"
+        RSEQ_CS_ABORT
+        : [obj] "=&r"(obj)
+        : [rseq_cs] "m"(rs->rseq_cs), [cpu_id] "m"(rs->cpu_id),
+          [stride] "r"(sizeof(CpuCache)), [base] "r"(base)
+        : "rax", "rcx", "memory", "cc");
+
+    if (obj) TSAN_ACQUIRE(obj);
+    return obj;
+}
+
+/**
+ * @return false if this cpu's cache of size_class is full
+ */
+bool cpuPush(struct rseq* rs, size_t size_class, void* obj) {
+    long pushed;
+    char* base = (char*)&cpu_caches[0].classes[size_class];
+    TSAN_RELEASE(obj);
+
+    asm volatile(
+        RSEQ_CS_ENTER
+        "movq (%%rax), %%rcx\n\t"             // count
+        "cmpq %[cap], %%rcx\n\t"
+        "jae 5f\n\t"
+        "movq %[obj], 8(%%rax, %%rcx, 8)\n\t"  // items[count], invisible until committed
+        "incq %%rcx\n\t"
+        "movq %%rcx, (%%rax)\n\t"             // commit
+        "2:\n\t"
+        "movl $1, %k[pushed]\n\t"
+        "jmp 6f\n\t"
+        "5:\n\t"
+        "xorl %k[pushed], %k[pushed]\n\t"
+        "6:\n\t"
+        RSEQ_CS_ABORT
+        : [pushed] "=&r"(pushed)
+        : [rseq_cs] "m"(rs->rseq_cs), [cpu_id] "m"(rs->cpu_id),
+          [stride] "r"(sizeof(CpuCache)), [base] "r"(base),
+          [obj] "r"(obj), [cap] "i"(CPU_CACHE_SIZE)
+        : "rax", "rcx", "memory", "cc");
+
+    return pushed;
+}
+#else
+void* cpuPop(struct rseq*, size_t) { return nullptr; }
+bool cpuPush(struct rseq*, size_t, void*) { return false; }
+#endif
+
+/**
+ * this cpu's cache is empty: take a batch, keep one for the caller
+ */
+void* cpuRefill(struct rseq* rs, size_t size_class) {
+    Batch batch = transferPop(size_class, CPU_CACHE_SIZE / 2, nullptr);
+    if (batch.count == 0) return nullptr;
+
+    FreeObject* obj = batch.head;
+    FreeObject* next = obj->next;
+
+    // we may have moved to another cpu meanwhile, that is fine
+    while (next) {
+        FreeObject* after = next->next;
+        if (!cpuPush(rs, size_class, next)) {
+            centralPush(size_class, next, batch.tail);
+            break;
+        }
+        next = after;
+    }
+
+    return obj;
+}
+
+/**
+ * this cpu's cache is full: move half of it (and obj) out as one batch
+ */
+void cpuOverflow(struct rseq* rs, size_t size_class, void* obj) {
+    Batch batch = {(FreeObject*)obj, (FreeObject*)obj, 1};
+    batch.head->next = nullptr;
+
+    for (size_t i = 0; i < CPU_CACHE_SIZE / 2; i++) {
+        auto next = (FreeObject*)cpuPop(rs, size_class);
+        if (!next) break;
+
+        next->next = batch.head;
+        batch.head = next;
+        batch.count++;
+    }
+
+    transferPush(size_class, batch);
+}
+
+/*---------------SCAVENGER----------------------------------*/
+/**
+ * hands every free object cached by exited threads to the transfer caches
+ */
+void flushOrphans() {
+    pthread_mutex_lock(&orphans_lock);
+
+    for (ThreadCache* cache = orphans; cache; cache = cache->next_orphan) {
+        drainRemote(cache);
+
+        for (size_t size_class = 0; size_class < NUM_CLASSES; size_class++) {
+            FreeList& list = cache->lists[size_class];
+            if (!list.head) continue;
+
+            Batch batch = {list.head, list.head, list.count};
+            while (batch.tail->next) batch.tail = batch.tail->next;
+            transferPush(size_class, batch);
+            scavenged_objects.fetch_add(list.count, std::memory_order_relaxed);
+
+            // an adopting thread starts with small batches again
+            list.head = nullptr;
+            list.count = 0;
+            list.batch = MIN_BATCH;
+        }
+    }
+
+    pthread_mutex_unlock(&orphans_lock);
+}
+
+/**
+ * the memory budget's cache flush, see sbudget_set_cache_flush
+ */
+bool flushForBudget() {
+    if (in_page_heap) return false; // page_heap_lock is ours
+
+    flushOrphans();
+    releaseFreeRegions();
+    return true;
+}
+
+void* scavengerMain(void*) {
+    pthread_mutex_lock(&scavenger_lock);
+
+    while (!scavenger_stopping) {
+        SScavengerConfig config = scavenger_config;
+
+        timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += config.period_ms / 1000;
+        deadline.tv_nsec += (config.period_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        pthread_cond_timedwait(&scavenger_wakeup, &scavenger_lock, &deadline);
+        if (scavenger_stopping) break;
+        pthread_mutex_unlock(&scavenger_lock);
+
+        // one pass per period, spurge drops the heap lock every max_blocks blocks
+        size_t idle_ticks = (config.idle_ms + config.period_ms - 1) / config.period_ms;
+        flushOrphans();
+        spanPurge(idle_ticks);
+        spurge(idle_ticks, config.max_blocks);
+
+        pthread_mutex_lock(&scavenger_lock);
+    }
+
+    pthread_mutex_unlock(&scavenger_lock);
+    return nullptr;
+}
+
+/*------------THREAD CACHE FUNCTIONS-------------------------------*/
+bool smalloc_percpu_enabled() {
+    return cpuCacheArea() != nullptr;
+}
+
+void* smalloc_mt(size_t size) {
+    // check conditions, the heap checks the rest
+    if (size == 0) return nullptr;
+    if (size >= MMAP_THRESHOLD) return smalloc(size);
+    if (size > SMALL_MAX) {
+        Span* span = spanAlloc((size + SPAN_PAGE - 1) >> PAGE_SHIFT, SPAN_MEDIUM, nullptr);
+        return span ? spanAddress(span) : nullptr;
+    }
+
+    size_t size_class = sizeClass(size);
+
+    struct rseq* rs = cpuCacheArea();
+    if (rs) {
+        void* obj = cpuPop(rs, size_class);
+        return obj ? obj : cpuRefill(rs, size_class);
+    }
+
+    ThreadCache* cache = localCache();
+    if (!cache) return smalloc(size);
+
+    // frees from other threads first, in one batch
+    if (cache->remote_free.load(std::memory_order_relaxed)) drainRemote(cache);
+
+    FreeList& list = cache->lists[size_class];
+    if (!list.head && !refill(cache, size_class)) return nullptr;
+
+    FreeObject* obj = list.head;
+    list.head = obj->next;
+    list.count--;
+
+    return obj;
+}
+
+void* scalloc_mt(size_t num, size_t size) {
+    if (size != 0 && num > (size_t)-1 / size) return nullptr; // overflow
+
+    void* alloc = smalloc_mt(num * size);
+    if (!alloc) return nullptr;
+
+    memset(alloc, 0, num * size);
+    return alloc;
+}
+
+void sfree_mt(void* p) {
+    if (!p) return;
+
+    Span* span = pagemapGet(p);
+    if (!span) {
+        sfree(p);
+        return;
+    }
+
+    if (span->size_class == SPAN_MEDIUM) {
+        spanFree(span);
+        return;
+    }
+
+    // per-cpu objects go back to whatever cpu we run on
+    if (!span->owner) {
+        struct rseq* rs = cpuCacheArea();
+        if (!rs) {
+            centralPush(span->size_class, (FreeObject*)p, (FreeObject*)p);
+            return;
+        }
+        if (!cpuPush(rs, span->size_class, p)) cpuOverflow(rs, span->size_class, p);
+        return;
+    }
+
+    // our own object stays in our cache, no atomics
+    if (span->owner == holder.cache) {
+        cachePush(holder.cache, span->size_class, (FreeObject*)p);
+        return;
+    }
+
+    pushRemote(span->owner, (FreeObject*)p);
+}
+
+void* srealloc_mt(void* oldp, size_t size) {
+    if (!oldp) return smalloc_mt(size);
+    if (size == 0) return nullptr;
+
+    Span* span = pagemapGet(oldp);
+    if (!span) return srealloc(oldp, size);
+
+    size_t old_size = span->size_class == SPAN_MEDIUM ? span->pages << PAGE_SHIFT : size_classes[span->size_class];
+    if (size <= old_size) return oldp;
+
+    void* newp = smalloc_mt(size);
+    if (!newp) return nullptr;
+
+    memcpy(newp, oldp, old_size);
+    sfree_mt(oldp);
+
+    return newp;
+}
+
+void* smallocx_mt(size_t size, int flags) {
+    size_t cached = cachedSize(size, flags);
+    if (!cached) return smallocx(size, flags);
+
+    auto p = (char*) smalloc_mt(cached);
+    if (!p) return nullptr;
+
+    // no cache for this thread, smalloc_mt went to the heap
+    size_t alignment = (size_t)1 << (flags & SMALLOCX_LG_ALIGN_MASK);
+    if ((size_t)p & (alignment - 1)) {
+        sfree_mt(p);
+        return smallocx(size, flags);
+    }
+
+    if (flags & SMALLOCX_ZERO) memset(p, 0, size);
+    if (flags & SMALLOCX_POPULATE) prefault(p, size);
+    return p;
+}
+
+void sdallocx_mt(void* p, size_t size, int flags) {
+    if (!p) return;
+
+    size_t cached = cachedSize(size, flags);
+    struct rseq* rs = cached && cached <= SMALL_MAX ? cpuCacheArea() : nullptr;
+    if (!rs) {
+        sfree_mt(p);
+        return;
+    }
+
+    // with per-cpu caches every small object comes from a slab, the size gives its class
+    size_t size_class = sizeClass(cached);
+    assert(pagemapGet(p) && pagemapGet(p)->size_class == size_class);
+    if (!cpuPush(rs, size_class, p)) cpuOverflow(rs, size_class, p);
+}
+
+bool sscavenger_start(const SScavengerConfig* config) {
+    pthread_mutex_lock(&scavenger_lock);
+    if (scavenger_running) {
+        pthread_mutex_unlock(&scavenger_lock);
+        return false;
+    }
+
+    scavenger_config = {SCAVENGER_PERIOD_MS, SCAVENGER_IDLE_MS, SCAVENGER_MAX_BLOCKS};
+    if (config) scavenger_config = *config;
+    if (scavenger_config.period_ms == 0) scavenger_config.period_ms = SCAVENGER_PERIOD_MS;
+
+    scavenger_stopping = false;
+    scavenger_running = pthread_create(&scavenger_thread, nullptr, scavengerMain, nullptr) == 0;
+    bool started = scavenger_running;
+
+    pthread_mutex_unlock(&scavenger_lock);
+    return started;
+}
+
+void sscavenger_stop() {
+    pthread_mutex_lock(&scavenger_lock);
+    if (!scavenger_running) {
+        pthread_mutex_unlock(&scavenger_lock);
+        return;
+    }
+
+    scavenger_stopping = true;
+    pthread_cond_signal(&scavenger_wakeup);
+    pthread_mutex_unlock(&scavenger_lock);
+
+    pthread_join(scavenger_thread, nullptr);
+
+    pthread_mutex_lock(&scavenger_lock);
+    scavenger_running = false;
+    pthread_mutex_unlock(&scavenger_lock);
+}
+
+size_t _num_scavenged_objects() {
+    return scavenged_objects.load(std::memory_order_relaxed);
+}
+
+size_t _num_purged_span_bytes() {
+    pthread_mutex_lock(&page_heap_lock);
+    size_t bytes = span_purged_bytes;
+    pthread_mutex_unlock(&page_heap_lock);
+    return bytes;
+}
@@ -0,0 +1,568 @@
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <assert.h>
+#include <pthread.h>
+#include "malloc_4.h"
+
+/*---------------DECLARATIONS-----------------------------------*/
+#define PHEAP_MAGIC 0x50484541504d3450 // "P4MPAEHP"
+#define PHEAP_VERSION 1
+#define MIN_PHEAP_SIZE 65536    // = 64*1024
+#define ATTACH_WAIT_US 1000
+#define ATTACH_TRIES 1000       // ~1s for the creating process to set the heap up
+
+// like MallocMetadata, with offsets from the start of the mapping instead of pointers.
+// the mapping may sit at another address in every process (0 = none, the header is there)
+struct PMetadata {
+    size_t size;
+    bool is_free;
+
+    size_t next_free; // sorted by address
+    size_t prev_free;
+
+    size_t heap_next; // every block has, sorted by address
+    size_t heap_prev;
+};
+
+// at offset 0 of the mapping, blocks follow it up to heap_end
+struct PHeader {
+    size_t magic;
+    size_t version;
+    size_t capacity;        // bytes mapped, fixed when the heap is created
+    size_t initialized;     // set last by the creator, attachers wait for it
+
+    pthread_mutex_t lock;   // process shared and robust, guards everything below
+    size_t repairs;         // times a process died holding the lock
+
+    size_t root;            // what a reattaching process starts from
+    size_t free_head;       // first free block
+    size_t heap_head;
+    size_t wilderness;
+    size_t heap_end;        // our own program break
+
+    size_t free_blocks, free_bytes, allocated_blocks, allocated_bytes;
+};
+
+// a process' view of a heap
+struct SPHeap {
+    char* base;
+    size_t capacity;
+};
+
+/*---------------HELPER FUNCTIONS---------------------------*/
+size_t pheapAlign(size_t size) {
+    return (size + 7) & ~(size_t)7;
+}
+
+size_t pheapMetaSize() {
+    return pheapAlign(sizeof(PMetadata));
+}
+
+size_t pheapHeaderSize() {
+    return (sizeof(PHeader) + 15) & ~(size_t)15;
+}
+
+PHeader* pheapHeader(SPHeap* heap) {
+    return (PHeader*)heap->base;
+}
+
+PMetadata* pheapAt(SPHeap* heap, size_t offset) {
+    return offset ? (PMetadata*)(heap->base + offset) : nullptr;
+}
+
+size_t pheapOffset(SPHeap* heap, PMetadata* block) {
+    return block ? (char*)block - heap->base : 0;
+}
+
+PMetadata* pheapBlockOf(void* p) {
+    return (PMetadata*)((char*)p - pheapMetaSize());
+}
+
+void* pheapPayload(PMetadata* block) {
+    return (char*)block + pheapMetaSize();
+}
+
+/**
+ * @param block - a free block to be added to the free list
+ */
+void pheapAddFree(SPHeap* heap, PMetadata* block) {
+    PHeader* header = pheapHeader(heap);
+    size_t offset = pheapOffset(heap, block);
+
+    header->free_blocks++;
+    header->free_bytes += block->size;
+    block->is_free = true;
+
+    // find the first free block after ours
+    PMetadata* prev = nullptr;
+    PMetadata* iter = pheapAt(heap, header->free_head);
+    while (iter && iter < block) {
+        prev = iter;
+        iter = pheapAt(heap, iter->next_free);
+    }
+
+    block->prev_free = pheapOffset(heap, prev);
+    block->next_free = pheapOffset(heap, iter);
+    if (prev) prev->next_free = offset;
+    else header->free_head = offset;
+    if (iter) iter->prev_free = offset;
+}
+
+void pheapRemoveFree(SPHeap* heap, PMetadata* block) {
+    PHeader* header = pheapHeader(heap);
+
+    PMetadata* prev = pheapAt(heap, block->prev_free);
+    PMetadata* next = pheapAt(heap, block->next_free);
+    if (prev) prev->next_free = block->next_free;
+    else header->free_head = block->next_free;
+    if (next) next->prev_free = block->prev_free;
+
+    block->next_free = 0;
+    block->prev_free = 0;
+    block->is_free = false;
+
+    header->free_blocks--;
+    header->free_bytes -= block->size;
+}
+
+/**
+ * @param block - a block of the heap list, absorbs next (which is removed from the list)
+ */
+void pheapAbsorbNext(SPHeap* heap, PMetadata* block, PMetadata* next) {
+    PHeader* header = pheapHeader(heap);
+
+    block->size += pheapMetaSize() + next->size;
+    block->heap_next = next->heap_next;
+    if (next->heap_next) pheapAt(heap, next->heap_next)->heap_prev = pheapOffset(heap, block);
+    if (header->wilderness == pheapOffset(heap, next)) header->wilderness = pheapOffset(heap, block);
+
+    header->allocated_blocks--;
+    header->allocated_bytes += pheapMetaSize();
+}
+
+/**
+ * @param block - a free block (in the free list), merged with its free neighbours
+ * @return the free block that contains it
+ */
+PMetadata* pheapCombine(SPHeap* heap, PMetadata* block) {
+    PMetadata* prev = pheapAt(heap, block->heap_prev);
+    PMetadata* next = pheapAt(heap, block->heap_next);
+
+    // blocks of the mapping always touch, no adjacency checks needed
+    if (next && next->is_free) {
+        pheapRemoveFree(heap, block);
+        pheapRemoveFree(heap, next);
+        pheapAbsorbNext(heap, block, next);
+        pheapAddFree(heap, block);
+    }
+
+    if (prev && prev->is_free) {
+        pheapRemoveFree(heap, prev);
+        pheapRemoveFree(heap, block);
+        pheapAbsorbNext(heap, prev, block);
+        pheapAddFree(heap, prev);
+        block = prev;
+    }
+
+    return block;
+}
+
+/**
+ * @param block - an allocated block, its tail beyond size becomes a free block if it's large enough
+ */
+void pheapCut(SPHeap* heap, PMetadata* block, size_t size) {
+    PHeader* header = pheapHeader(heap);
+    if (block->size < pheapMetaSize() + size + 128) return;
+
+    auto rest = (PMetadata*)((char*)pheapPayload(block) + size);
+    rest->size = block->size - size - pheapMetaSize();
+    rest->is_free = false;
+    rest->next_free = 0;
+    rest->prev_free = 0;
+
+    // update heap list
+    rest->heap_prev = pheapOffset(heap, block);
+    rest->heap_next = block->heap_next;
+    if (block->heap_next) pheapAt(heap, block->heap_next)->heap_prev = pheapOffset(heap, rest);
+    block->heap_next = pheapOffset(heap, rest);
+    if (header->wilderness == pheapOffset(heap, block)) header->wilderness = pheapOffset(heap, rest);
+
+    block->size = size;
+    header->allocated_blocks++;
+    header->allocated_bytes -= pheapMetaSize();
+
+    pheapAddFree(heap, rest);
+    pheapCombine(heap, rest);
+}
+
+/**
+ * @param size - aligned
+ * @return false if the mapping can't fit it
+ */
+bool pheapGrowWilderness(SPHeap* heap, size_t size) {
+    PHeader* header = pheapHeader(heap);
+    PMetadata* wilderness = pheapAt(heap, header->wilderness);
+
+    size_t missing = size - wilderness->size;
+    if (header->capacity - header->heap_end < missing) return false;
+
+    header->heap_end += missing;
+    header->allocated_bytes += missing;
+    wilderness->size = size;
+
+    return true;
+}
+
+/*---------------BLOCK FUNCTIONS (heap lock held)-----------*/
+void* pheapAlloc(SPHeap* heap, size_t size) {
+    PHeader* header = pheapHeader(heap);
+    if (size == 0 || size > header->capacity) return nullptr;
+    size = pheapAlign(size);
+
+    // first fit
+    PMetadata* block = pheapAt(heap, header->free_head);
+    while (block && block->size < size) block = pheapAt(heap, block->next_free);
+    if (block) {
+        pheapRemoveFree(heap, block);
+        pheapCut(heap, block, size);
+        return pheapPayload(block);
+    }
+
+    // a free wilderness grows into the rest of the mapping
+    PMetadata* wilderness = pheapAt(heap, header->wilderness);
+    if (wilderness && wilderness->is_free) {
+        pheapRemoveFree(heap, wilderness);
+        if (pheapGrowWilderness(heap, size)) return pheapPayload(wilderness);
+
+        pheapAddFree(heap, wilderness);
+        return nullptr;
+    }
+
+    if (header->capacity - header->heap_end < pheapMetaSize() + size) return nullptr;
+
+    auto new_block = (PMetadata*)(heap->base + header->heap_end);
+    new_block->size = size;
+    new_block->is_free = false;
+    new_block->next_free = 0;
+    new_block->prev_free = 0;
+    new_block->heap_next = 0;
+    new_block->heap_prev = header->wilderness;
+
+    size_t offset = header->heap_end;
+    if (wilderness) wilderness->heap_next = offset;
+    else header->heap_head = offset;
+    header->wilderness = offset;
+    header->heap_end += pheapMetaSize() + size;
+
+    header->allocated_blocks++;
+    header->allocated_bytes += size;
+
+    return pheapPayload(new_block);
+}
+
+void pheapFree(SPHeap* heap, void* p) {
+    PMetadata* block = pheapBlockOf(p);
+    if (block->is_free) return;
+
+    pheapAddFree(heap, block);
+    pheapCombine(heap, block);
+}
+
+void* pheapRealloc(SPHeap* heap, void* oldp, size_t size) {
+    PMetadata* block = pheapBlockOf(oldp);
+    if (size == 0 || size > pheapHeader(heap)->capacity) return nullptr;
+    size = pheapAlign(size);
+
+    if (size <= block->size) {
+        pheapCut(heap, block, size);
+        return oldp;
+    }
+
+    // grow in place: into the rest of the mapping, or into a free next block
+    if (pheapOffset(heap, block) == pheapHeader(heap)->wilderness) {
+        if (pheapGrowWilderness(heap, size)) return oldp;
+    } else {
+        PMetadata* next = pheapAt(heap, block->heap_next);
+        if (next && next->is_free && block->size + pheapMetaSize() + next->size >= size) {
+            pheapRemoveFree(heap, next);
+            pheapAbsorbNext(heap, block, next);
+            pheapCut(heap, block, size);
+            return oldp;
+        }
+    }
+
+    void* newp = pheapAlloc(heap, size);
+    if (!newp) return nullptr;
+
+    memmove(newp, oldp, block->size);
+    pheapFree(heap, oldp);
+
+    return newp;
+}
+
+/**
+ * rebuilds the lists and the stats from the blocks, after a process died in the middle of
+ * an operation. every step of an operation leaves the block sizes walkable from the header
+ * on, so the walk only stops early at a block the dead process was appending: heap_end
+ * moves back to the last whole block. a block it was allocating or splitting off may stay allocated
+ */
+void pheapRepair(SPHeap* heap) {
+    PHeader* header = pheapHeader(heap);
+    if (header->heap_end < pheapHeaderSize() || header->heap_end > header->capacity)
+        header->heap_end = pheapHeaderSize();
+
+    header->free_head = 0;
+    header->heap_head = 0;
+    header->free_blocks = 0;
+    header->free_bytes = 0;
+    header->allocated_blocks = 0;
+    header->allocated_bytes = 0;
+
+    PMetadata* last = nullptr;
+    PMetadata* last_free = nullptr;
+    size_t offset = pheapHeaderSize();
+    while (header->heap_end - offset >= pheapMetaSize()) {
+        PMetadata* block = pheapAt(heap, offset);
+        size_t size = block->size;
+        if (size == 0 || size != pheapAlign(size) || size > header->heap_end - offset - pheapMetaSize()) break;
+        offset += pheapMetaSize() + size;
+
+        // the dead process was merging them
+        if (block->is_free && last && last->is_free) {
+            last->size += pheapMetaSize() + size;
+            header->free_bytes += pheapMetaSize() + size;
+            header->allocated_bytes += pheapMetaSize() + size;
+            continue;
+        }
+
+        size_t block_offset = pheapOffset(heap, block);
+        block->heap_prev = pheapOffset(heap, last);
+        block->heap_next = 0;
+        if (last) last->heap_next = block_offset;
+        else header->heap_head = block_offset;
+        last = block;
+        header->allocated_blocks++;
+        header->allocated_bytes += size;
+
+        block->prev_free = 0;
+        block->next_free = 0;
+        if (!block->is_free) continue;
+
+        // blocks are walked in address order, so is the free list
+        block->prev_free = pheapOffset(heap, last_free);
+        if (last_free) last_free->next_free = block_offset;
+        else header->free_head = block_offset;
+        last_free = block;
+        header->free_blocks++;
+        header->free_bytes += size;
+    }
+
+    header->heap_end = offset;
+    header->wilderness = pheapOffset(heap, last);
+    header->repairs++;
+}
+
+/**
+ * sets up the header of a new heap (no other process sees it yet)
+ */
+bool pheapInit(PHeader* header, size_t capacity) {
+    memset(header, 0, sizeof(PHeader));
+    header->magic = PHEAP_MAGIC;
+    header->version = PHEAP_VERSION;
+    header->capacity = capacity;
+    header->heap_end = pheapHeaderSize();
+
+    pthread_mutexattr_t attr;
+    if (pthread_mutexattr_init(&attr) != 0) return false;
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    int res = pthread_mutex_init(&header->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (res != 0) return false;
+
+    // publish
+    __atomic_store_n(&header->initialized, 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+int pheapOpenBacking(const char* name, SPHeapKind kind, int flags) {
+    if (kind == SPHEAP_SHM) return shm_open(name, flags, 0600);
+    return open(name, flags, 0600);
+}
+
+struct PHeapGuard {
+    SPHeap* heap;
+
+    PHeapGuard(SPHeap* h) : heap(h) {
+        // a process died holding the lock, its last operation may be half done
+        if (pthread_mutex_lock(&pheapHeader(heap)->lock) == EOWNERDEAD) {
+            pheapRepair(heap);
+            pthread_mutex_consistent(&pheapHeader(heap)->lock);
+        }
+    }
+    ~PHeapGuard() { pthread_mutex_unlock(&pheapHeader(heap)->lock); }
+};
+
+/**
+ * @param abandoned - set if the backing object exists but its creator never set the heap up,
+ *                    backing is then the object that was found
+ */
+SPHeap* pheapOpen(const char* name, SPHeapKind kind, size_t size, bool* abandoned, struct stat* backing) {
+    // whoever creates the backing object sets the heap up
+    int fd = pheapOpenBacking(name, kind, O_RDWR | O_CREAT | O_EXCL);
+    bool created = fd >= 0;
+    if (!created) {
+        if (errno != EEXIST) return nullptr;
+        fd = pheapOpenBacking(name, kind, O_RDWR);
+        if (fd < 0) return nullptr;
+    }
+
+    size_t page_size = getpagesize();
+    if (created) {
+        if (size < MIN_PHEAP_SIZE) size = MIN_PHEAP_SIZE;
+        size = (size + page_size - 1) & ~(page_size - 1);
+        if (ftruncate(fd, size) != 0) size = 0;
+    } else {
+        // the creator may not have sized it yet
+        for (size_t i = 0; i < ATTACH_TRIES; i++) {
+            if (fstat(fd, backing) != 0 || backing->st_size != 0) break;
+            usleep(ATTACH_WAIT_US);
+        }
+        size = backing->st_size;
+        *abandoned = size == 0;
+    }
+
+    void* mem = MAP_FAILED;
+    if (size >= MIN_PHEAP_SIZE) mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    auto header = (PHeader*)mem;
+    bool ready = mem != MAP_FAILED;
+    if (ready && created) {
+        ready = pheapInit(header, size);
+    } else if (ready) {
+        for (size_t i = 0; i < ATTACH_TRIES && !__atomic_load_n(&header->initialized, __ATOMIC_ACQUIRE); i++)
+            usleep(ATTACH_WAIT_US);
+
+        bool initialized = __atomic_load_n(&header->initialized, __ATOMIC_ACQUIRE);
+        ready = initialized && header->magic == PHEAP_MAGIC && header->version == PHEAP_VERSION &&
+                header->capacity == size;
+        *abandoned = !initialized;
+    }
+
+    auto heap = ready ? (SPHeap*) smalloc(sizeof(SPHeap)) : nullptr;
+    if (!heap) {
+        if (mem != MAP_FAILED) munmap(mem, size);
+        if (created) spheap_remove(name, kind); // don't leave a broken heap behind
+        return nullptr;
+    }
+
+    heap->base = (char*)mem;
+    heap->capacity = size;
+    return heap;
+}
+
+/**
+ * removes the backing object if the name still refers to backing
+ */
+void pheapRemoveAbandoned(const char* name, SPHeapKind kind, struct stat* backing) {
+    int fd = pheapOpenBacking(name, kind, O_RDWR);
+    if (fd < 0) return;
+
+    struct stat st = {};
+    bool same = fstat(fd, &st) == 0 && st.st_dev == backing->st_dev && st.st_ino == backing->st_ino;
+    close(fd);
+    // another process may replace it between the check and the unlink, it would have
+    // to find the same object abandoned and re-create it in that window
+    if (same) spheap_remove(name, kind);
+}
+
+/*------------PERSISTENT HEAP FUNCTIONS-------------------------------*/
+SPHeap* spheap_open(const char* name, SPHeapKind kind, size_t size) {
+    if (!name) return nullptr;
+
+    bool abandoned = false;
+    struct stat backing = {};
+    SPHeap* heap = pheapOpen(name, kind, size, &abandoned, &backing);
+    if (heap || !abandoned) return heap;
+
+    // its creator died before setting it up, start over. when another process got here
+    // first the name refers to its new heap, which is attached to
+    pheapRemoveAbandoned(name, kind, &backing);
+    abandoned = false;
+    return pheapOpen(name, kind, size, &abandoned, &backing);
+}
+
+void spheap_close(SPHeap* heap) {
+    if (!heap) return;
+
+    munmap(heap->base, heap->capacity);
+    sfree(heap);
+}
+
+bool spheap_remove(const char* name, SPHeapKind kind) {
+    if (!name) return false;
+    if (kind == SPHEAP_SHM) return shm_unlink(name) == 0;
+    return unlink(name) == 0;
+}
+
+void* spheap_alloc(SPHeap* heap, size_t size) {
+    if (!heap) return nullptr;
+
+    PHeapGuard guard(heap);
+    return pheapAlloc(heap, size);
+}
+
+void spheap_free(SPHeap* heap, void* p) {
+    if (!heap || !p) return;
+
+    PHeapGuard guard(heap);
+    pheapFree(heap, p);
+}
+
+void* spheap_realloc(SPHeap* heap, void* oldp, size_t size) {
+    if (!heap) return nullptr;
+    if (!oldp) return spheap_alloc(heap, size);
+
+    PHeapGuard guard(heap);
+    return pheapRealloc(heap, oldp, size);
+}
+
+size_t spheap_to_offset(SPHeap* heap, void* p) {
+    if (!heap || !p) return 0;
+
+    assert((char*)p > heap->base && (char*)p < heap->base + heap->capacity);
+    return (char*)p - heap->base;
+}
+
+void* spheap_from_offset(SPHeap* heap, size_t offset) {
+    if (!heap || offset == 0 || offset >= heap->capacity) return nullptr;
+    return heap->base + offset;
+}
+
+void spheap_set_root(SPHeap* heap, void* root) {
+    if (!heap) return;
+
+    PHeapGuard guard(heap);
+    pheapHeader(heap)->root = spheap_to_offset(heap, root);
+}
+
+void* spheap_root(SPHeap* heap) {
+    if (!heap) return nullptr;
+
+    PHeapGuard guard(heap);
+    return spheap_from_offset(heap, pheapHeader(heap)->root);
+}
+
+SPHeapStats spheap_stats(SPHeap* heap) {
+    if (!heap) return {0, 0, 0, 0, 0, 0};
+
+    PHeader* header = pheapHeader(heap);
+    PHeapGuard guard(heap);
+    return {header->capacity, header->free_blocks, header->free_bytes, header->allocated_blocks, header->allocated_bytes,
+            header->repairs};
+}
@@ -0,0 +1,70 @@
+#ifndef OS4_MALLOC_PMR_H
+#define OS4_MALLOC_PMR_H
+
+#include <memory_resource>
+#include <new>
+#include "malloc_4.h"
+
+/**
+ * std::pmr::memory_resource over malloc_4.
+ * use smalloc_resource() for the shared instance.
+ * the size given to deallocate is only checked (see sfree_sized), and every call
+ * takes the heap lock and a first fit search: containers of many small nodes are
+ * much slower than with std::allocator (bench_pmr.cpp)
+ */
+class SmallocResource : public std::pmr::memory_resource {
+protected:
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        void* p = smalloc_aligned(alignment, bytes ? bytes : 1);
+        if (!p) throw std::bad_alloc();
+        return p;
+    }
+
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+        (void)alignment; // the block knows where it starts
+        sfree_sized(p, bytes ? bytes : 1);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        // every instance allocates from the same heap
+        return dynamic_cast<const SmallocResource*>(&other) != nullptr;
+    }
+};
+
+inline SmallocResource* smalloc_resource() {
+    static SmallocResource resource;
+    return &resource;
+}
+
+/**
+ * std::allocator compatible template over malloc_4, as SmallocResource
+ */
+template <typename T>
+class SmallocAllocator {
+public:
+    using value_type = T;
+
+    SmallocAllocator() noexcept = default;
+    template <typename U>
+    SmallocAllocator(const SmallocAllocator<U>&) noexcept {}
+
+    T* allocate(size_t n) {
+        if (n == 0) n = 1;
+        if (n > (size_t)-1 / sizeof(T)) throw std::bad_array_new_length();
+
+        void* p = smalloc_aligned(alignof(T), n * sizeof(T));
+        if (!p) throw std::bad_alloc();
+        return (T*)p;
+    }
+
+    void deallocate(T* p, size_t n) noexcept {
+        sfree_sized(p, (n ? n : 1) * sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(const SmallocAllocator<U>&) const noexcept { return true; }
+    template <typename U>
+    bool operator!=(const SmallocAllocator<U>&) const noexcept { return false; }
+};
+
+#endif //OS4_MALLOC_PMR_H
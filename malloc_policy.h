@@ -0,0 +1,472 @@
+#ifndef OS4_MALLOC_POLICY_H
+#define OS4_MALLOC_POLICY_H
+
+#include <unistd.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <assert.h>
+#include <type_traits>
+
+/*---------------POLICIES---------------------------------------*/
+// how smalloc picks a block out of the free list
+enum class FitPolicy {
+    FirstFit,   // lowest address that is big enough (malloc_2 - malloc_4)
+    BestFit     // smallest block that is big enough
+};
+
+// what sfree / srealloc do with free neighbours
+enum class CoalescePolicy {
+    None,       // blocks never merge and the wilderness never grows (malloc_2)
+    Neighbors   // merge adjacent free blocks, grow the wilderness in place (malloc_3, malloc_4)
+};
+
+constexpr size_t NO_SPLIT = (size_t)-1; // SplitThreshold value: never cut blocks
+constexpr size_t NO_MMAP = (size_t)-1;  // MmapThreshold value: never use mmap
+
+/**
+ * One allocator core for the simple parts of the assignment and tuned variants of them.
+ * Each policy is a template parameter, so a disabled feature is removed by
+ * "if constexpr" and an instantiation costs exactly what its policy needs.
+ *
+ * @tparam Fit - block search over the free list
+ * @tparam Alignment - every size (and the metadata) is rounded to this, power of 2
+ * @tparam SplitThreshold - a block is cut when at least this many bytes are left
+ *                          after the metadata of the new block (LARGE_ENOUGH)
+ * @tparam MmapThreshold - sizes from here onwards are served by mmap
+ * @tparam Coalesce - what happens to free neighbours
+ */
+template <FitPolicy Fit, size_t Alignment, size_t SplitThreshold, size_t MmapThreshold, CoalescePolicy Coalesce>
+class PolicyAllocator {
+    static_assert(Alignment != 0 && (Alignment & (Alignment - 1)) == 0, "Alignment must be a power of 2");
+
+    static constexpr bool USES_MMAP = MmapThreshold != NO_MMAP;
+    // blocks are cut or merged: they must know their neighbours
+    static constexpr bool LINKS_HEAP = SplitThreshold != NO_SPLIT || Coalesce == CoalescePolicy::Neighbors;
+
+public:
+    static constexpr size_t MAX_ALLOC = 100000000;
+
+    /*------------ASSIGNMENT FUNCTIONS------------------------------*/
+    void* smalloc(size_t size) {
+        // check conditions
+        if (size == 0 || size > MAX_ALLOC) return nullptr;
+
+        size = align(size);
+
+        if constexpr (USES_MMAP) {
+            if (size >= MmapThreshold) return mmapBlock(size);
+        }
+
+        MallocMetadata* to_alloc = findFit(size);
+        if (to_alloc) { // we found a block!
+            // remove from list (+ update global variables)
+            removeFromFreeList(to_alloc);
+
+            // if block large enough, cut it
+            splitIfLargeEnough(to_alloc, size);
+
+            return payload(to_alloc);
+        }
+
+        if constexpr (Coalesce == CoalescePolicy::Neighbors) {
+            // if no free block was found and the wilderness chunk is free, enlarge it
+            if (wilderness && wilderness->is_free && atProgramBreak(wilderness)) {
+                removeFromFreeList(wilderness);
+                if (enlargeWilderness(size)) return payload(wilderness);
+
+                addToFreeList(wilderness); // sbrk failed, put it back
+                return nullptr;
+            }
+        }
+
+        return sbrkBlock(size);
+    }
+
+    void* scalloc(size_t num, size_t size) {
+        if (size != 0 && num > MAX_ALLOC / size) return nullptr; // overflow
+
+        void* alloc = smalloc(num * size);
+        if (!alloc) return nullptr;
+
+        // if mmaped no need to nullify
+        if constexpr (USES_MMAP) {
+            if (meta(alloc)->is_mmap) return alloc;
+        }
+
+        memset(alloc, 0, num * size);
+        return alloc;
+    }
+
+    void sfree(void* p) {
+        // check if null or released
+        if (!p) return;
+        MallocMetadata* block = meta(p);
+        if (block->is_free) return;
+
+        if constexpr (USES_MMAP) {
+            if (block->is_mmap) {
+                allocated_blocks--;
+                allocated_bytes -= block->size;
+
+                int res = munmap(block, block->size + metaSize());
+                assert(res == 0);
+                (void)res;
+                return;
+            }
+        }
+
+        addToFreeList(block);
+        if constexpr (Coalesce == CoalescePolicy::Neighbors) combineBlocks(block);
+    }
+
+    void* srealloc(void* oldp, size_t size) {
+        // check parameters
+        if (size == 0 || size > MAX_ALLOC) return nullptr;
+
+        // if given null pointer, allocate normally
+        if (oldp == nullptr) return smalloc(size);
+
+        MallocMetadata* block = meta(oldp);
+        size_t old_size = block->size;
+        size = align(size);
+
+        // mmap()-ed blocks always move
+        if constexpr (USES_MMAP) {
+            if (block->is_mmap) return reallocate(oldp, old_size, size);
+        }
+
+        // if size is smaller, reuse the same block
+        if (size <= old_size) {
+            splitIfLargeEnough(block, size);
+            return oldp;
+        }
+
+        if constexpr (Coalesce == CoalescePolicy::Neighbors) {
+            // the wilderness grows in place
+            if (block == wilderness && atProgramBreak(block))
+                return enlargeWilderness(size) ? oldp : nullptr;
+
+            MallocMetadata* merged = tryMergingNeighbor(block, size);
+            if (merged) {
+                splitIfLargeEnough(merged, size);
+                return payload(merged);
+            }
+        }
+
+        return reallocate(oldp, old_size, size);
+    }
+
+    /*------------STATISTICS----------------------------------------*/
+    size_t _num_free_blocks() const { return free_blocks; }
+    size_t _num_free_bytes() const { return free_bytes; }
+    size_t _num_allocated_blocks() const { return allocated_blocks; }
+    size_t _num_allocated_bytes() const { return allocated_bytes; }
+    size_t _num_meta_data_bytes() const { return allocated_blocks * metaSize(); }
+    static constexpr size_t _size_meta_data() { return metaSize(); }
+
+private:
+    struct HeapMetadata {
+        size_t size;
+        bool is_free;
+        bool is_mmap;
+
+        HeapMetadata* next_free; // if not free then null
+        HeapMetadata* prev_free; // sorted by address
+
+        HeapMetadata* heap_next; // every sbrk block has
+        HeapMetadata* heap_prev; // sorted by address
+    };
+
+    // blocks that are never cut, merged or mmap'ed (malloc_2)
+    struct ListMetadata {
+        size_t size;
+        bool is_free;
+
+        ListMetadata* next_free; // if not free then null
+        ListMetadata* prev_free; // sorted by address
+    };
+
+    using MallocMetadata = std::conditional_t<LINKS_HEAP || USES_MMAP, HeapMetadata, ListMetadata>;
+
+    size_t free_blocks = 0, free_bytes = 0, allocated_blocks = 0, allocated_bytes = 0;
+
+    MallocMetadata dummy_free = {};
+    MallocMetadata* heap_head = nullptr;
+    MallocMetadata* wilderness = nullptr;
+
+    /*---------------HELPER FUNCTIONS-------------------------------*/
+    static constexpr size_t align(size_t size) {
+        return (size + Alignment - 1) & ~(Alignment - 1);
+    }
+
+    static constexpr size_t metaSize() {
+        return align(sizeof(MallocMetadata));
+    }
+
+    static MallocMetadata* meta(void* p) {
+        return (MallocMetadata*)((char*)p - metaSize());
+    }
+
+    static void* payload(MallocMetadata* block) {
+        return (char*)block + metaSize();
+    }
+
+    // several instances share one program break, so heap_next is not always the physical neighbour
+    static bool adjacent(MallocMetadata* block, MallocMetadata* next) {
+        return (char*)payload(block) + block->size == (char*)next;
+    }
+
+    static bool atProgramBreak(MallocMetadata* block) {
+        return (char*)payload(block) + block->size == (char*)sbrk(0);
+    }
+
+    MallocMetadata* findFit(size_t size) {
+        MallocMetadata* iter = dummy_free.next_free;
+
+        if constexpr (Fit == FitPolicy::FirstFit) {
+            while (iter && iter->size < size) iter = iter->next_free;
+            return iter;
+        } else {
+            MallocMetadata* best = nullptr;
+            for (; iter; iter = iter->next_free) {
+                if (iter->size < size) continue;
+                if (!best || iter->size < best->size) best = iter;
+                if (best->size == size) break; // can't do better
+            }
+            return best;
+        }
+    }
+
+    /**
+     * @param block - a free block to be added to the (address sorted) free list
+     */
+    void addToFreeList(MallocMetadata* block) {
+        assert(block);
+
+        free_blocks++;
+        free_bytes += block->size;
+        block->is_free = true;
+
+        MallocMetadata* iter = &dummy_free;
+        while (iter->next_free && iter->next_free < block) iter = iter->next_free;
+
+        block->prev_free = iter;
+        block->next_free = iter->next_free;
+        if (iter->next_free) iter->next_free->prev_free = block;
+        iter->next_free = block;
+    }
+
+    /**
+     * @param block - a block to be removed from the free list
+     */
+    void removeFromFreeList(MallocMetadata* block) {
+        assert(block && block->is_free);
+
+        if (block->prev_free) block->prev_free->next_free = block->next_free;
+        if (block->next_free) block->next_free->prev_free = block->prev_free;
+        block->prev_free = nullptr;
+        block->next_free = nullptr;
+        block->is_free = false;
+
+        free_blocks--;
+        free_bytes -= block->size;
+    }
+
+    /**
+     * @param block - a block outside the free list, cut if it is LARGE ENOUGH
+     */
+    void splitIfLargeEnough(MallocMetadata* block, size_t wanted_size) {
+        if constexpr (SplitThreshold != NO_SPLIT) {
+            if (block->size >= metaSize() + wanted_size + SplitThreshold) splitBlock(block, wanted_size);
+        } else {
+            (void)block; (void)wanted_size;
+        }
+    }
+
+    /**
+     * @param block - a block outside the free list, LARGE ENOUGH to be cut
+     * the tail after wanted_size becomes a new free block, not merged with a free
+     * neighbour (as in malloc_3 / malloc_4)
+     */
+    void splitBlock(MallocMetadata* block, size_t wanted_size) {
+        auto rest = (MallocMetadata*)((char*)payload(block) + wanted_size);
+        rest->size = block->size - wanted_size - metaSize();
+        rest->is_mmap = false;
+
+        // update heap list
+        rest->heap_prev = block;
+        rest->heap_next = block->heap_next;
+        if (block->heap_next) block->heap_next->heap_prev = rest;
+        block->heap_next = rest;
+        if (block == wilderness) wilderness = rest;
+
+        block->size = wanted_size;
+
+        // the new metadata is taken out of the user bytes
+        allocated_blocks++;
+        allocated_bytes -= metaSize();
+
+        addToFreeList(rest);
+    }
+
+    /**
+     * @param block - its heap_next is adjacent and already out of the free list
+     */
+    void absorbNext(MallocMetadata* block) {
+        MallocMetadata* next = block->heap_next;
+
+        block->size += metaSize() + next->size;
+        block->heap_next = next->heap_next;
+        if (next->heap_next) next->heap_next->heap_prev = block;
+        if (next == wilderness) wilderness = block;
+
+        allocated_blocks--;
+        allocated_bytes += metaSize();
+    }
+
+    /**
+     * @param block - a free block to merge with adjacent free blocks
+     */
+    void combineBlocks(MallocMetadata* block) {
+        removeFromFreeList(block);
+
+        MallocMetadata* next = block->heap_next;
+        if (next && next->is_free && adjacent(block, next)) {
+            removeFromFreeList(next);
+            absorbNext(block);
+        }
+
+        MallocMetadata* prev = block->heap_prev;
+        if (prev && prev->is_free && adjacent(prev, block)) {
+            removeFromFreeList(prev);
+            absorbNext(prev);
+            block = prev;
+        }
+
+        addToFreeList(block);
+    }
+
+    /**
+     * @param block - an allocated block to grow over its free neighbours
+     * @return the merged block with the old data at its start, or nullptr
+     */
+    MallocMetadata* tryMergingNeighbor(MallocMetadata* block, size_t wanted_size) {
+        MallocMetadata* prev = block->heap_prev;
+        MallocMetadata* next = block->heap_next;
+
+        bool free_prev = prev && prev->is_free && adjacent(prev, block);
+        bool free_next = next && next->is_free && adjacent(block, next);
+        size_t block_size = block->size + metaSize();
+        void* data = payload(block);
+        size_t data_size = block->size;
+
+        // same order as malloc_3: previous, next, both
+        if (free_prev && prev->size + block_size >= wanted_size) {
+            removeFromFreeList(prev);
+            absorbNext(prev);
+            memmove(payload(prev), data, data_size);
+            return prev;
+        }
+
+        if (free_next && next->size + block_size >= wanted_size) {
+            removeFromFreeList(next);
+            absorbNext(block);
+            return block;
+        }
+
+        if (free_prev && free_next && prev->size + next->size + block_size + metaSize() >= wanted_size) {
+            removeFromFreeList(prev);
+            removeFromFreeList(next);
+            absorbNext(block);
+            absorbNext(prev);
+            memmove(payload(prev), data, data_size);
+            return prev;
+        }
+
+        return nullptr;
+    }
+
+    void* reallocate(void* oldp, size_t old_size, size_t new_size) {
+        void* newp = smalloc(new_size);
+        if (newp == nullptr) return nullptr;
+
+        memmove(newp, oldp, old_size < new_size ? old_size : new_size);
+        sfree(oldp);
+
+        return newp;
+    }
+
+    /**
+     * @param size - the desired final size of the wilderness
+     */
+    bool enlargeWilderness(size_t size) {
+        size_t missing_size = size - wilderness->size;
+        if (sbrk(missing_size) == (void*)(-1)) return false;
+
+        allocated_bytes += missing_size;
+        wilderness->size += missing_size;
+
+        return true;
+    }
+
+    void* mmapBlock(size_t size) {
+        void* res = mmap(NULL, metaSize() + size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (res == MAP_FAILED) return nullptr;
+
+        auto block = (MallocMetadata*)res;
+        block->size = size;
+        block->is_mmap = true;
+        block->is_free = false;
+
+        allocated_blocks++;
+        allocated_bytes += size;
+
+        return payload(block);
+    }
+
+    void* sbrkBlock(size_t size) {
+        // align the program break, someone else may have moved it
+        void* program_break = sbrk(0);
+        if (program_break == (void*)(-1)) return nullptr;
+
+        size_t padding = align((size_t)program_break) - (size_t)program_break;
+        void* res = sbrk(padding + metaSize() + size);
+        if (res == (void*)(-1)) return nullptr;
+
+        auto block = (MallocMetadata*)((char*)res + padding);
+        block->size = size;
+        block->is_free = false;
+        block->next_free = nullptr;
+        block->prev_free = nullptr;
+
+        if constexpr (LINKS_HEAP || USES_MMAP) {
+            block->is_mmap = false;
+            block->heap_next = nullptr;
+            block->heap_prev = wilderness;
+
+            if (wilderness) wilderness->heap_next = block;
+            else heap_head = block;
+            wilderness = block;
+        }
+
+        allocated_blocks++;
+        allocated_bytes += size;
+
+        return payload(block);
+    }
+};
+
+/*---------------INSTANTIATIONS---------------------------------*/
+#define POLICY_MMAP_THRESHOLD 131072 // = 128*1024
+
+// the assignment parts: malloc_2.cpp and malloc_3.cpp are these instantiations.
+// part 4 is malloc_4.cpp only, the allocator every extension is built into
+using Malloc2Allocator = PolicyAllocator<FitPolicy::FirstFit, 1, NO_SPLIT, NO_MMAP, CoalescePolicy::None>;
+using Malloc3Allocator = PolicyAllocator<FitPolicy::FirstFit, 1, 128, POLICY_MMAP_THRESHOLD, CoalescePolicy::Neighbors>;
+
+// tuned configurations
+using BestFitAllocator = PolicyAllocator<FitPolicy::BestFit, 8, 128, POLICY_MMAP_THRESHOLD, CoalescePolicy::Neighbors>;
+using CompactAllocator = PolicyAllocator<FitPolicy::BestFit, 16, 32, 4 * POLICY_MMAP_THRESHOLD, CoalescePolicy::Neighbors>;
+using BumpAllocator = PolicyAllocator<FitPolicy::FirstFit, 16, NO_SPLIT, NO_MMAP, CoalescePolicy::None>;
+
+#endif //OS4_MALLOC_POLICY_H
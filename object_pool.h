@@ -0,0 +1,288 @@
+#ifndef OS4_OBJECT_POOL_H
+#define OS4_OBJECT_POOL_H
+
+#include <new>
+#include <mutex>
+#include <atomic>
+#include <utility>
+#include "malloc_4.h"
+
+/**
+ * Fixed size slots for T, carved out of chunks taken with smalloc_aligned.
+ * A slot has no header: free slots are linked through their own bytes.
+ *
+ * @tparam ChunkObjects - slots per chunk
+ * @tparam ThreadCache - keep a per-thread list of free slots in front of the
+ *                       shared one (the shared list is then guarded by a mutex).
+ *                       Every pool has its own list in every thread that used it,
+ *                       given back when the thread exits, dropped when the pool goes.
+ */
+template <typename T, size_t ChunkObjects = 64, bool ThreadCache = false>
+class ObjectPool {
+    static_assert(ChunkObjects > 0, "a chunk must hold at least one object");
+
+    union Slot {
+        Slot* next; // while free
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    struct Chunk {
+        Chunk* next;
+    };
+
+    // slots start after the chunk header, at the slot's alignment
+    static constexpr size_t SLOT_ALIGN = alignof(Slot) > alignof(Chunk) ? alignof(Slot) : alignof(Chunk);
+    static constexpr size_t HEADER_SIZE = (sizeof(Chunk) + SLOT_ALIGN - 1) & ~(SLOT_ALIGN - 1);
+
+    static constexpr size_t CACHE_SIZE = 64;  // max free slots a thread keeps
+    static constexpr size_t CACHE_BATCH = 32; // slots moved per refill / flush
+
+    struct LocalCache {
+        std::atomic<ObjectPool*> owner{nullptr}; // nullptr once the pool is destroyed
+        Slot* head = nullptr;
+        size_t count = 0;
+        LocalCache* next = nullptr;         // in its thread's list
+        LocalCache* pool_next = nullptr;    // in its owner's list (registry lock held)
+        LocalCache* pool_prev = nullptr;
+    };
+
+    // the caches of one thread, one per pool of this type it used
+    struct ThreadCaches {
+        LocalCache* first = nullptr;
+
+        ~ThreadCaches() {
+            std::lock_guard<std::mutex> guard(registryLock());
+            while (first) {
+                LocalCache* cache = first;
+                first = cache->next;
+
+                ObjectPool* owner = cache->owner.load(std::memory_order_relaxed);
+                if (owner) {
+                    owner->unlinkCache(cache);
+                    owner->pushList(cache->head, cache->count);
+                }
+                delete cache;
+            }
+        }
+    };
+
+public:
+    ObjectPool() = default;
+    ObjectPool(const ObjectPool&) = delete;
+    ObjectPool& operator=(const ObjectPool&) = delete;
+
+    /**
+     * every object must be destroyed (or abandoned) before the pool is
+     */
+    ~ObjectPool() {
+        if constexpr (ThreadCache) {
+            // the slots every thread keeps for us are in the chunks freed below
+            std::lock_guard<std::mutex> guard(registryLock());
+            for (LocalCache* cache = caches; cache; cache = cache->pool_next) {
+                cache->owner.store(nullptr, std::memory_order_release);
+            }
+            caches = nullptr;
+        }
+
+        Chunk* chunk = chunks;
+        while (chunk) {
+            Chunk* next = chunk->next;
+            sfree(chunk);
+            chunk = next;
+        }
+    }
+
+    /**
+     * @return an uninitialized slot for a T, or nullptr if the heap is out of memory
+     */
+    T* allocate() {
+        if constexpr (ThreadCache) {
+            LocalCache* cache = localCache();
+            if (cache) {
+                if (!cache->head) refill(*cache);
+                if (!cache->head) return nullptr;
+
+                Slot* slot = cache->head;
+                cache->head = slot->next;
+                cache->count--;
+                return (T*)slot->storage;
+            }
+            // no memory for a cache, use the shared list
+        }
+
+        std::unique_lock<std::mutex> guard = lock();
+        if (!free_list && !addChunk()) return nullptr;
+
+        Slot* slot = free_list;
+        free_list = slot->next;
+        return (T*)slot->storage;
+    }
+
+    /**
+     * @param p - a slot from allocate(), whose T was already destroyed
+     */
+    void deallocate(T* p) {
+        if (!p) return;
+        auto slot = (Slot*)p;
+
+        if constexpr (ThreadCache) {
+            LocalCache* cache = localCache();
+            if (cache) {
+                slot->next = cache->head;
+                cache->head = slot;
+                if (++cache->count > CACHE_SIZE) flush(*cache);
+                return;
+            }
+        }
+
+        pushList(slot, 1);
+    }
+
+    template <typename... Args>
+    T* construct(Args&&... args) {
+        T* p = allocate();
+        if (!p) return nullptr;
+
+        try {
+            return new (p) T(std::forward<Args>(args)...);
+        } catch (...) {
+            deallocate(p);
+            throw;
+        }
+    }
+
+    void destroy(T* p) {
+        if (!p) return;
+
+        p->~T();
+        deallocate(p);
+    }
+
+private:
+    Slot* free_list = nullptr;
+    Chunk* chunks = nullptr;
+    std::mutex mutex;
+    LocalCache* caches = nullptr;   // of every thread (registry lock held)
+
+    // guards the pools' lists of caches and the owner of every cache, for all pools of this type
+    static std::mutex& registryLock() {
+        static std::mutex registry;
+        return registry;
+    }
+
+    /**
+     * @return this thread's cache for this pool, nullptr if there's no memory for one
+     */
+    LocalCache* localCache() {
+        static thread_local ThreadCaches thread_caches;
+
+        // the last one used goes first, a thread mostly uses one pool at a time
+        LocalCache* prev = nullptr;
+        LocalCache* unused = nullptr;
+        for (LocalCache* cache = thread_caches.first; cache; prev = cache, cache = cache->next) {
+            ObjectPool* owner = cache->owner.load(std::memory_order_acquire);
+            if (owner == this) {
+                if (prev) {
+                    prev->next = cache->next;
+                    cache->next = thread_caches.first;
+                    thread_caches.first = cache;
+                }
+                return cache;
+            }
+            if (!owner && !unused) unused = cache;
+        }
+
+        // the cache of a destroyed pool is taken over, its slots are gone
+        LocalCache* cache = unused;
+        if (!cache) {
+            cache = new (std::nothrow) LocalCache();
+            if (!cache) return nullptr;
+            cache->next = thread_caches.first;
+            thread_caches.first = cache;
+        }
+        cache->head = nullptr;
+        cache->count = 0;
+
+        std::lock_guard<std::mutex> guard(registryLock());
+        cache->pool_prev = nullptr;
+        cache->pool_next = caches;
+        if (caches) caches->pool_prev = cache;
+        caches = cache;
+        cache->owner.store(this, std::memory_order_relaxed);
+        return cache;
+    }
+
+    /**
+     * @param cache - one of ours, its thread exits (registry lock held)
+     */
+    void unlinkCache(LocalCache* cache) {
+        if (cache->pool_prev) cache->pool_prev->pool_next = cache->pool_next;
+        else caches = cache->pool_next;
+        if (cache->pool_next) cache->pool_next->pool_prev = cache->pool_prev;
+    }
+
+    std::unique_lock<std::mutex> lock() {
+        if constexpr (ThreadCache) return std::unique_lock<std::mutex>(mutex);
+        else return std::unique_lock<std::mutex>();
+    }
+
+    /**
+     * takes a new chunk from the heap and links all of its slots (lock held)
+     */
+    bool addChunk() {
+        auto chunk = (Chunk*) smalloc_aligned(SLOT_ALIGN, HEADER_SIZE + ChunkObjects * sizeof(Slot));
+        if (!chunk) return false;
+
+        chunk->next = chunks;
+        chunks = chunk;
+
+        auto slots = (Slot*)((char*)chunk + HEADER_SIZE);
+        for (size_t i = 0; i + 1 < ChunkObjects; i++) slots[i].next = &slots[i + 1];
+        slots[ChunkObjects - 1].next = free_list;
+        free_list = slots;
+
+        return true;
+    }
+
+    /**
+     * @param head - a list of count slots, given back to the shared free list
+     */
+    void pushList(Slot* head, size_t count) {
+        if (!head) return;
+
+        Slot* tail = head;
+        for (size_t i = 1; i < count; i++) tail = tail->next;
+
+        std::unique_lock<std::mutex> guard = lock();
+        tail->next = free_list;
+        free_list = head;
+    }
+
+    void refill(LocalCache& cache) {
+        std::unique_lock<std::mutex> guard = lock();
+
+        while (cache.count < CACHE_BATCH) {
+            if (!free_list && !addChunk()) break;
+
+            Slot* slot = free_list;
+            free_list = slot->next;
+            slot->next = cache.head;
+            cache.head = slot;
+            cache.count++;
+        }
+    }
+
+    void flush(LocalCache& cache) {
+        // keep the most recently freed (still hot) slots
+        Slot* last_kept = cache.head;
+        for (size_t i = 1; i < cache.count - CACHE_BATCH; i++) last_kept = last_kept->next;
+
+        Slot* batch = last_kept->next;
+        last_kept->next = nullptr;
+        cache.count -= CACHE_BATCH;
+
+        pushList(batch, CACHE_BATCH);
+    }
+};
+
+#endif //OS4_OBJECT_POOL_H
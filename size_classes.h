@@ -0,0 +1,17 @@
+// the default table, written by hand: the classes and split threshold malloc_4 always had.
+// gen_size_classes replaces this file with one generated from a service's allocation sizes
+#ifndef OS4_SIZE_CLASSES_H
+#define OS4_SIZE_CLASSES_H
+
+#include <stddef.h>
+
+#define NUM_CLASSES 20
+#define SPLIT_THRESHOLD 128 // smallest remainder a free block is split into
+
+// object sizes of the small classes, multiples of 16
+constexpr size_t size_classes[NUM_CLASSES] = {
+    16, 32, 48, 64, 80, 96, 112, 128, 160, 192,
+    224, 256, 320, 384, 448, 512, 640, 768, 896, 1024
+};
+
+#endif //OS4_SIZE_CLASSES_H
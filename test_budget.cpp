@@ -0,0 +1,170 @@
+#include <iostream>
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include <vector>
+#include "malloc_4.h"
+using namespace std;
+
+// build: g++ -std=c++17 -O2 -pthread test_budget.cpp malloc_4.cpp malloc_4_mt.cpp -o test_budget
+
+#define BIG 200000 // mmap'ed, freeing one gives its bytes back
+#define MAX_CALLBACKS 16
+
+// blocks an application keeps around and can drop when asked
+struct Cache {
+    int id;
+    size_t per_call;
+    vector<void*> blocks;
+};
+
+vector<int> calls;
+
+void releaseCache(size_t excess, void* context) {
+    auto cache = (Cache*)context;
+    assert(excess > 0);
+    calls.push_back(cache->id);
+    for (size_t i = 0; i < cache->per_call && !cache->blocks.empty(); i++) {
+        sfree(cache->blocks.back());
+        cache->blocks.pop_back();
+    }
+}
+
+void ignore(size_t, void*) {}
+
+void testSoftLimit() {
+    Cache a = {1, 1, {}}, b = {2, 2, {}}, c = {3, 1, {}};
+    for (int i = 0; i < 4; i++) {
+        a.blocks.push_back(smalloc(BIG));
+        b.blocks.push_back(smalloc(BIG));
+        c.blocks.push_back(smalloc(BIG));
+    }
+    assert(sbudget_add_reclaim(releaseCache, &a));
+    assert(sbudget_add_reclaim(releaseCache, &b));
+    assert(sbudget_add_reclaim(releaseCache, &c));
+
+    SBudgetStats before = sbudget_stats();
+    SMemoryBudget budget = {before.footprint + BIG / 2, 0};
+    sbudget_set(&budget);
+
+    // 1.5 BIG over: a isn't enough, b brings it under, c isn't asked
+    void* over = smalloc(2 * BIG);
+    assert(over);
+    SBudgetStats after = sbudget_stats();
+    assert((calls == vector<int>{1, 2}));
+    assert(after.reclaims == before.reclaims + 1);
+    assert(after.reclaimed_bytes >= before.reclaimed_bytes + 3 * BIG);
+    assert(after.footprint <= budget.soft_limit);
+    sfree(over);
+
+    // a removed, the next crossing starts with b
+    sbudget_remove_reclaim(releaseCache, &a);
+    calls.clear();
+    over = smalloc(5 * BIG);
+    assert(over);
+    assert((calls == vector<int>{2}));
+    assert(sbudget_stats().reclaims == before.reclaims + 2);
+    assert(sbudget_stats().footprint <= budget.soft_limit);
+    sfree(over);
+
+    sbudget_remove_reclaim(releaseCache, &b);
+    sbudget_remove_reclaim(releaseCache, &c);
+    sbudget_remove_reclaim(ignore, nullptr); // not registered, nothing happens
+    sbudget_set(nullptr);
+    for (Cache* cache : {&a, &b, &c})
+        for (void* p : cache->blocks) sfree(p);
+    cout << "soft limit callbacks: ok" << endl;
+}
+
+void testCallbackLimit() {
+    int contexts[MAX_CALLBACKS + 1];
+    for (int i = 0; i < MAX_CALLBACKS; i++) assert(sbudget_add_reclaim(ignore, &contexts[i]));
+    assert(!sbudget_add_reclaim(ignore, &contexts[MAX_CALLBACKS]));
+    assert(!sbudget_add_reclaim(nullptr, nullptr));
+
+    sbudget_remove_reclaim(ignore, &contexts[0]);
+    assert(sbudget_add_reclaim(ignore, &contexts[MAX_CALLBACKS]));
+    for (int i = 1; i <= MAX_CALLBACKS; i++) sbudget_remove_reclaim(ignore, &contexts[i]);
+    cout << "callback limit: ok" << endl;
+}
+
+void testHardLimit() {
+    SBudgetStats before = sbudget_stats();
+    SMemoryBudget budget = {0, before.footprint + BIG};
+    sbudget_set(&budget);
+
+    assert(!smalloc(2 * BIG));
+    assert(sbudget_stats().hard_failures == before.hard_failures + 1);
+    void* small = smalloc(BIG / 4);
+    assert(small);
+    sfree(small);
+
+    sbudget_set(nullptr);
+    cout << "hard limit: ok" << endl;
+}
+
+// a block followed by the free wilderness, under a hard limit that stops both sbrk and relocation
+void testWildernessOverBudget() {
+    char* p = (char*)smalloc(1000);
+    char* wilderness = (char*)smalloc(5000);
+    memset(p, 7, 1000);
+    sfree(wilderness);
+
+    size_t size = susable_size(p);
+    size_t free_blocks = _num_free_blocks(), free_bytes = _num_free_bytes();
+    size_t bytes = _num_allocated_bytes();
+    SMemoryBudget budget = {0, sbudget_stats().footprint + 1000};
+    sbudget_set(&budget);
+    size_t failures = sbudget_stats().hard_failures;
+
+    assert(!srealloc(p, 20000));
+    assert(sbudget_stats().hard_failures > failures);
+    // the free wilderness wasn't merged into it
+    assert(susable_size(p) == size);
+    assert(_num_free_blocks() == free_blocks && _num_free_bytes() == free_bytes);
+    assert(_num_allocated_bytes() == bytes);
+    for (int i = 0; i < 1000; i++) assert(p[i] == 7);
+
+    // without the limit it grows in place
+    sbudget_set(nullptr);
+    size_t merged = srealloc_stats().merge_next_wilderness;
+    char* q = (char*)srealloc(p, 20000);
+    assert(q == p && susable_size(q) >= 20000);
+    assert(srealloc_stats().merge_next_wilderness == merged + 1);
+    sfree(q);
+    cout << "wilderness over the budget: ok" << endl;
+}
+
+void* cacheAndExit(void*) {
+    void* objs[200];
+    for (void*& p : objs) p = smalloc_mt(48);
+    for (void* p : objs) sfree_mt(p);
+    return nullptr;
+}
+
+// the page heap registers its flush: a reclaim empties the caches of exited threads
+void testCacheFlush() {
+    pthread_t t;
+    pthread_create(&t, nullptr, cacheAndExit, nullptr);
+    pthread_join(t, nullptr);
+
+    size_t scavenged = _num_scavenged_objects();
+    SBudgetStats before = sbudget_stats();
+    SMemoryBudget budget = {before.footprint + BIG / 2, 0};
+    sbudget_set(&budget);
+    sfree(smalloc(2 * BIG));
+    assert(sbudget_stats().reclaims == before.reclaims + 1);
+    if (!smalloc_percpu_enabled()) assert(_num_scavenged_objects() > scavenged);
+
+    sbudget_set(nullptr);
+    cout << "cache flush: ok" << endl;
+}
+
+int main() {
+    testWildernessOverBudget(); // first, no free block it could relocate to
+    testSoftLimit();
+    testCallbackLimit();
+    testHardLimit();
+    testCacheFlush();
+    return 0;
+}
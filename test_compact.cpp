@@ -0,0 +1,108 @@
+#include <iostream>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include "malloc_4.h"
+using namespace std;
+
+// build: g++ -std=c++17 -O2 test_compact.cpp malloc_4.cpp -o test_compact
+
+#define ROUNDS 50
+#define HANDLES 8
+
+size_t handleSize(int i) {
+    return 500 + 100 * i;
+}
+
+// the block scompact stops at slides into the wilderness and is trimmed,
+// the next call must not resume from it
+void testResumeAfterTrim() {
+    void* hole = smalloc(1000);
+    SHandle first = shandle_alloc(500);
+    sfree(hole);
+
+    SCompactStats before = scompact_stats();
+    assert(scompact(1) > 0);
+    SCompactStats after = scompact_stats();
+    assert(after.passes == before.passes + 1);
+    assert(after.moved_blocks == before.moved_blocks + 1);
+    assert(after.trimmed_bytes > before.trimmed_bytes);
+
+    // someone else sbrk's over what was trimmed
+    char* other = (char*)sbrk(65536);
+    memset(other, 0xff, 65536);
+    scompact(1);
+    sbrk(-65536);
+
+    shandle_free(first);
+    cout << "resume after a trim: ok" << endl;
+}
+
+// many small steps, the handles keep their bytes wherever they are moved
+void testRepeatedSteps() {
+    SCompactStats before = scompact_stats();
+    int calls = 0;
+
+    for (int round = 0; round < ROUNDS; round++) {
+        SHandle handles[HANDLES];
+        void* holes[HANDLES];
+        for (int i = 0; i < HANDLES; i++) {
+            holes[i] = smalloc(1000);
+            handles[i] = shandle_alloc(handleSize(i));
+            memset(shandle_lock(handles[i]), i, handleSize(i));
+            shandle_unlock(handles[i]);
+        }
+        for (int i = 0; i < HANDLES; i++) sfree(holes[i]);
+
+        for (int i = 0; i < 20; i++) {
+            scompact(2);
+            char* other = (char*)sbrk(65536);
+            memset(other, 0xff, 65536);
+            scompact(2);
+            sbrk(-65536);
+            calls += 2;
+        }
+
+        for (int i = 0; i < HANDLES; i++) {
+            char* p = (char*)shandle_lock(handles[i]);
+            for (size_t j = 0; j < handleSize(i); j++) assert(p[j] == (char)i);
+            shandle_unlock(handles[i]);
+            shandle_free(handles[i]);
+        }
+    }
+
+    SCompactStats after = scompact_stats();
+    assert(after.passes == before.passes + calls);
+    assert(after.moved_blocks > before.moved_blocks);
+    assert(after.moved_bytes > before.moved_bytes);
+    cout << "repeated steps: ok" << endl;
+}
+
+// a locked handle is never moved
+void testLockedStays() {
+    void* hole = smalloc(1000);
+    SHandle handle = shandle_alloc(500);
+    sfree(hole);
+
+    char* p = (char*)shandle_lock(handle);
+    memset(p, 9, 500);
+    size_t moved = scompact_stats().moved_blocks;
+    for (int i = 0; i < 10; i++) scompact(0);
+    assert(scompact_stats().moved_blocks == moved);
+    assert(shandle_lock(handle) == p);
+    shandle_unlock(handle);
+    shandle_unlock(handle);
+
+    shandle_free(handle);
+    cout << "locked handles stay: ok" << endl;
+}
+
+int main() {
+    testResumeAfterTrim();
+    testRepeatedSteps();
+    testLockedStays();
+
+    scompact(0);
+    assert(_num_allocated_blocks() - _num_free_blocks() < (size_t)HANDLES); // handle chunks
+    return 0;
+}
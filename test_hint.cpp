@@ -0,0 +1,101 @@
+#include <iostream>
+#include <assert.h>
+#include <string.h>
+#include <initializer_list>
+#include "malloc_4.h"
+using namespace std;
+
+// build: g++ -std=c++17 -O2 test_hint.cpp malloc_4.cpp -o test_hint
+
+size_t MMAP_THRESHOLD = 131072;
+size_t SEGMENT = 1 << 20;
+
+void testAdaptedThreshold() {
+    assert(smmap_threshold() == MMAP_THRESHOLD);
+
+    SMmapThresholdConfig config = {MMAP_THRESHOLD, 64 << 20};
+    smmap_threshold_adapt(&config);
+
+    // freeing an mmap'ed block raises the threshold over its size
+    size_t blocks = _num_allocated_blocks(), bytes = _num_allocated_bytes();
+    void* big = smalloc(2 * SEGMENT);
+    assert(big && _num_allocated_blocks() == blocks + 1);
+    sfree(big);
+    assert(_num_allocated_blocks() == blocks && _num_allocated_bytes() == bytes);
+    assert(smmap_threshold() > 2 * SEGMENT);
+
+    SThresholdChange changes[4];
+    assert(smmap_threshold_history(changes, 4) >= 1);
+    assert(changes[0].raised && changes[0].trigger_size >= 2 * SEGMENT);
+    assert(changes[0].threshold == smmap_threshold());
+    cout << "adapted threshold: ok" << endl;
+}
+
+// sizes under the raised threshold but over a sub-heap segment
+void testHintedOverSegment() {
+    size_t blocks = _num_allocated_blocks() - _num_free_blocks();
+
+    for (SLifetime lifetime : {SLIFETIME_SHORT, SLIFETIME_LONG}) {
+        char* fits = (char*)smalloc_hint(SEGMENT / 2, lifetime);
+        char* over = (char*)smalloc_hint(SEGMENT + SEGMENT / 2, lifetime);
+        assert(fits && over);
+        memset(fits, 1, SEGMENT / 2);
+        memset(over, 2, SEGMENT + SEGMENT / 2);
+        assert(susable_size(over) >= SEGMENT + SEGMENT / 2);
+
+        char* aligned = (char*)smallocx(SEGMENT, SMALLOCX_ALIGN(4096) | SMALLOCX_HEAP(lifetime));
+        assert(aligned && (size_t)aligned % 4096 == 0);
+        memset(aligned, 3, SEGMENT);
+
+        // a hinted block grown past a segment leaves its sub-heap
+        char* grown = (char*)smalloc_hint(100, lifetime);
+        memset(grown, 4, 100);
+        grown = (char*)srealloc(grown, SEGMENT + 1);
+        assert(grown && grown[99] == 4);
+
+        assert(fits[0] == 1 && over[SEGMENT] == 2 && aligned[SEGMENT - 1] == 3);
+        sfree(fits);
+        sfree(over);
+        sfree(aligned);
+        sfree(grown);
+    }
+
+    // only the kept segment of each sub-heap may stay
+    assert(_num_allocated_blocks() - _num_free_blocks() <= blocks + 2);
+    cout << "hinted allocations over a segment: ok" << endl;
+}
+
+// a raise that would pass max is ignored
+void testThresholdMax() {
+    SMmapThresholdConfig config = {MMAP_THRESHOLD, 4 * SEGMENT};
+    smmap_threshold_adapt(&config);
+    size_t threshold = smmap_threshold();
+    assert(threshold < 4 * SEGMENT - 8);
+
+    sfree(smalloc(4 * SEGMENT));
+    assert(smmap_threshold() == threshold);
+    sfree(smalloc(4 * SEGMENT - 8));
+    assert(smmap_threshold() == 4 * SEGMENT);
+    cout << "threshold max: ok" << endl;
+}
+
+void testAdaptOff() {
+    smmap_threshold_adapt(nullptr);
+    assert(smmap_threshold() == MMAP_THRESHOLD);
+
+    // the threshold is back, the size is mmap'ed again
+    size_t bytes = _num_allocated_bytes();
+    void* big = smalloc(2 * SEGMENT);
+    assert(big);
+    sfree(big);
+    assert(_num_allocated_bytes() == bytes && smmap_threshold() == MMAP_THRESHOLD);
+    cout << "adapting off: ok" << endl;
+}
+
+int main() {
+    testAdaptedThreshold();
+    testHintedOverSegment();
+    testThresholdMax();
+    testAdaptOff();
+    return 0;
+}
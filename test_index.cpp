@@ -0,0 +1,130 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include "malloc_4.cpp" // white box: the index is checked against the free lists
+using namespace std;
+
+// build: g++ -std=c++17 -O2 -pthread test_index.cpp -o test_index
+
+#define SLOTS 512
+#define ROUNDS 20000
+
+MallocMetadata* walkFirstFit(size_t heap, size_t size) {
+    MallocMetadata* block = freeListOf(heap)->next_free;
+    while (block && block->size < size) block = block->next_free;
+    return block;
+}
+
+// the index holds the blocks of the list, in the same order, with their sizes
+void checkIndex(size_t heap) {
+    FreeIndex& index = free_index[heap];
+    if (index.broken) return;
+
+    size_t i = 0;
+    for (MallocMetadata* block = freeListOf(heap)->next_free; block; block = block->next_free, i++) {
+        assert(i < index.count);
+        assert(index.blocks[i] == block && index.sizes[i] == block->size);
+    }
+    assert(i == index.count);
+}
+
+void checkFirstFit(size_t heap) {
+    for (size_t size : {8, 16, 64, 200, 1000, 4096, 20000, 100000}) assert(firstFit(heap, size) == walkFirstFit(heap, size));
+}
+
+void testScans() {
+    srand(1);
+    vector<size_t> sizes(100);
+    for (size_t count = 0; count <= sizes.size(); count++) {
+        for (size_t& size : sizes) size = 8 * (1 + rand() % 64);
+        for (size_t size : {8, 128, 256, 512, 520}) {
+            size_t expected = scanSizesScalar(sizes.data(), count, size);
+#if defined(__x86_64__)
+            if (__builtin_cpu_supports("sse4.2")) assert(scanSizesSse42(sizes.data(), count, size) == expected);
+            if (__builtin_cpu_supports("avx2")) assert(scanSizesAvx2(sizes.data(), count, size) == expected);
+#endif
+        }
+    }
+    cout << "simd scans agree: ok" << endl;
+}
+
+// random sizes and lifetimes in all three heaps, the indexes are checked after every call
+void testChurn() {
+    vector<char*> slots(SLOTS, nullptr);
+    for (unsigned seed = 1; seed <= 8; seed++) {
+        srand(seed);
+        for (int i = 0; i < ROUNDS; i++) {
+            int k = rand() % SLOTS;
+            size_t size = 16 + rand() % 5000;
+            if (!slots[k]) slots[k] = (char*)smalloc_hint(size, (SLifetime)(rand() % 3));
+            else if (rand() % 2) slots[k] = (char*)srealloc(slots[k], size);
+            else {
+                sfree(slots[k]);
+                slots[k] = nullptr;
+            }
+
+            for (size_t heap = 0; heap <= NUM_SUB_HEAPS; heap++) checkIndex(heap);
+        }
+        for (size_t heap = 0; heap <= NUM_SUB_HEAPS; heap++) checkFirstFit(heap);
+    }
+
+    for (char*& p : slots) {
+        sfree(p);
+        p = nullptr;
+    }
+    for (size_t heap = 0; heap <= NUM_SUB_HEAPS; heap++) checkIndex(heap);
+    cout << "index follows the lists: ok" << endl;
+}
+
+size_t addressSpace() {
+    ifstream status("/proc/self/status");
+    string line;
+    while (getline(status, line))
+        if (line.rfind("VmSize:", 0) == 0) return stoul(line.substr(7)) * 1024;
+    return 0;
+}
+
+// when the arrays can't grow, the list is walked from then on
+void testFallback() {
+    FreeIndex& index = free_index[SLIFETIME_DEFAULT];
+    assert(!index.broken);
+
+    // every other block freed, more than the index holds
+    size_t n = 2 * (index.capacity + 16);
+    vector<void*> blocks(n + 1);
+    for (void*& p : blocks) p = smalloc(32);
+
+    struct rlimit limit;
+    getrlimit(RLIMIT_AS, &limit);
+    struct rlimit no_growth = {addressSpace(), limit.rlim_max};
+    assert(setrlimit(RLIMIT_AS, &no_growth) == 0);
+    for (size_t i = 0; i < n; i += 2) sfree(blocks[i]);
+    setrlimit(RLIMIT_AS, &limit);
+    assert(index.broken);
+
+    // nothing was lost from the list
+    size_t listed = 0;
+    for (size_t heap = 0; heap <= NUM_SUB_HEAPS; heap++)
+        for (MallocMetadata* block = freeListOf(heap)->next_free; block; block = block->next_free) listed++;
+    assert(listed == _num_free_blocks());
+    checkFirstFit(SLIFETIME_DEFAULT);
+
+    // allocations still find the freed blocks
+    for (size_t i = 0; i < n; i += 2) {
+        MallocMetadata* fit = walkFirstFit(SLIFETIME_DEFAULT, 32);
+        blocks[i] = smalloc(32);
+        assert(blocks[i] == (char*)fit + _size_meta_data());
+    }
+    for (void* p : blocks) sfree(p);
+    checkFirstFit(SLIFETIME_DEFAULT);
+    cout << "list walk when the index can't grow: ok" << endl;
+}
+
+int main() {
+    testScans();
+    testChurn();
+    testFallback();
+    return 0;
+}
@@ -0,0 +1,200 @@
+#include <iostream>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <string>
+#include "malloc_4_persistent.cpp" // for the heap header, to die holding the lock
+using namespace std;
+
+// build: g++ -std=c++17 -O2 -pthread test_pheap.cpp malloc_4.cpp -o test_pheap
+
+#define PROCS 4
+#define SLOTS 64
+#define ROUNDS 2000
+#define HEAP_SIZE (1 << 20)
+
+string heapName(const char* prefix) {
+    return prefix + to_string(getpid());
+}
+
+// a block of the root list: its size, then its slot number in every other byte
+size_t* fillSlot(SPHeap* heap, size_t* slot_block, size_t slot, size_t size) {
+    auto block = (size_t*)spheap_realloc(heap, slot_block, size);
+    assert(block);
+    block[0] = size;
+    memset(block + 1, (char)slot, size - sizeof(size_t));
+    return block;
+}
+
+void checkSlot(size_t* block, size_t slot) {
+    auto bytes = (char*)(block + 1);
+    for (size_t i = 0; i < block[0] - sizeof(size_t); i++) assert(bytes[i] == (char)slot);
+}
+
+// every process attaches on its own and churns its part of the root list
+void churn(const char* name, int proc) {
+    SPHeap* heap = spheap_open(name, SPHEAP_FILE, 0);
+    assert(heap);
+    auto roots = (size_t*)spheap_root(heap);
+    assert(roots);
+
+    srand(proc + 1);
+    for (int i = 0; i < ROUNDS; i++) {
+        size_t slot = proc * SLOTS + rand() % SLOTS;
+        auto block = (size_t*)spheap_from_offset(heap, roots[slot]);
+        if (block) checkSlot(block, slot);
+
+        if (block && rand() % 3 == 0) {
+            spheap_free(heap, block);
+            block = nullptr;
+        } else {
+            // grows, shrinks or moves, the old bytes are checked on the next visit
+            block = fillSlot(heap, block, slot, sizeof(size_t) + 1 + rand() % 600);
+        }
+        roots[slot] = spheap_to_offset(heap, block);
+    }
+    spheap_close(heap);
+}
+
+void testSharedHeap() {
+    string name = heapName("/tmp/test_pheap_");
+    spheap_remove(name.c_str(), SPHEAP_FILE);
+
+    SPHeap* heap = spheap_open(name.c_str(), SPHEAP_FILE, HEAP_SIZE);
+    assert(heap);
+    auto roots = (size_t*)spheap_alloc(heap, PROCS * SLOTS * sizeof(size_t));
+    memset(roots, 0, PROCS * SLOTS * sizeof(size_t));
+    spheap_set_root(heap, roots);
+    spheap_close(heap);
+
+    pid_t pids[PROCS];
+    for (int proc = 0; proc < PROCS; proc++) {
+        pids[proc] = fork();
+        if (pids[proc] == 0) {
+            churn(name.c_str(), proc);
+            _exit(0);
+        }
+    }
+    for (int proc = 0; proc < PROCS; proc++) {
+        int status;
+        waitpid(pids[proc], &status, 0);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+    // reattach and walk the root list
+    heap = spheap_open(name.c_str(), SPHEAP_FILE, 0);
+    assert(heap);
+    roots = (size_t*)spheap_root(heap);
+    assert(roots);
+    size_t live = 0;
+    for (size_t slot = 0; slot < PROCS * SLOTS; slot++) {
+        auto block = (size_t*)spheap_from_offset(heap, roots[slot]);
+        if (!block) continue;
+        checkSlot(block, slot);
+        spheap_free(heap, block);
+        live++;
+    }
+    assert(live > 0);
+
+    // only the root list is left, the rest merged into one free block
+    SPHeapStats stats = spheap_stats(heap);
+    assert(stats.free_blocks == 1 && stats.allocated_blocks == 2 && stats.repairs == 0);
+    spheap_free(heap, roots);
+    stats = spheap_stats(heap);
+    assert(stats.free_blocks == 1 && stats.allocated_blocks == 1);
+
+    spheap_close(heap);
+    assert(spheap_remove(name.c_str(), SPHEAP_FILE));
+    cout << "shared heap: ok" << endl;
+}
+
+// a child takes the lock, breaks the heap the way a half done operation would, and dies
+template <typename F>
+void dieHoldingLock(SPHeap* heap, F breakHeap) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        pthread_mutex_lock(&pheapHeader(heap)->lock);
+        breakHeap();
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+}
+
+void testOwnerDeath() {
+    string name = heapName("/test_pheap_");
+    spheap_remove(name.c_str(), SPHEAP_SHM);
+    SPHeap* heap = spheap_open(name.c_str(), SPHEAP_SHM, HEAP_SIZE);
+    assert(heap);
+
+    void* blocks[8]; // blocks[i] is 200 + 100 * i bytes
+    for (int i = 0; i < 8; i++) blocks[i] = spheap_alloc(heap, 200 + 100 * i);
+    spheap_free(heap, blocks[1]);
+    spheap_free(heap, blocks[5]);
+    SPHeapStats before = spheap_stats(heap);
+
+    // lists and stats lost, a block appended halfway
+    dieHoldingLock(heap, [&] {
+        PHeader* header = pheapHeader(heap);
+        header->free_head = 0;
+        header->free_blocks = 0;
+        header->allocated_bytes = 0;
+        pheapBlockOf(blocks[3])->heap_next = 12345;
+        header->heap_end += 4096;
+    });
+    SPHeapStats after = spheap_stats(heap);
+    assert(after.repairs == before.repairs + 1);
+    assert(after.free_blocks == before.free_blocks && after.free_bytes == before.free_bytes);
+    assert(after.allocated_blocks == before.allocated_blocks && after.allocated_bytes == before.allocated_bytes);
+
+    // died freeing blocks[2], next to the free blocks[1]
+    dieHoldingLock(heap, [&] { pheapBlockOf(blocks[2])->is_free = true; });
+    after = spheap_stats(heap);
+    assert(after.repairs == before.repairs + 2);
+    assert(after.free_blocks == before.free_blocks);
+    assert(after.free_bytes == before.free_bytes + pheapMetaSize() + 400);
+    assert(after.allocated_blocks == before.allocated_blocks - 1);
+
+    // the heap works on
+    for (int i : {0, 3, 4, 6, 7}) spheap_free(heap, blocks[i]);
+    after = spheap_stats(heap);
+    assert(after.free_blocks == 1 && after.allocated_blocks == 1);
+    void* all = spheap_alloc(heap, after.free_bytes);
+    assert(all == blocks[0]);
+    spheap_free(heap, all);
+
+    spheap_close(heap);
+    assert(spheap_remove(name.c_str(), SPHEAP_SHM));
+    cout << "owner death: ok" << endl;
+}
+
+// the creator died before sizing the object, or before setting the heap up in it
+void testAbandoned() {
+    string name = heapName("/tmp/test_pheap_abandoned_");
+    int fd = open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    assert(fd >= 0);
+    close(fd);
+    SPHeap* heap = spheap_open(name.c_str(), SPHEAP_FILE, HEAP_SIZE);
+    assert(heap && spheap_stats(heap).capacity == HEAP_SIZE);
+    spheap_close(heap);
+    assert(spheap_remove(name.c_str(), SPHEAP_FILE));
+
+    name = heapName("/test_pheap_abandoned_");
+    fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    assert(fd >= 0 && ftruncate(fd, HEAP_SIZE) == 0);
+    close(fd);
+    heap = spheap_open(name.c_str(), SPHEAP_SHM, HEAP_SIZE);
+    assert(heap && spheap_alloc(heap, 100));
+    spheap_close(heap);
+    assert(spheap_remove(name.c_str(), SPHEAP_SHM));
+    cout << "abandoned heap re-created: ok" << endl;
+}
+
+int main() {
+    testSharedHeap();
+    testOwnerDeath();
+    testAbandoned();
+    return 0;
+}
@@ -0,0 +1,103 @@
+#include <iostream>
+#include <assert.h>
+#include <unistd.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "object_pool.h"
+using namespace std;
+
+// build: g++ -std=c++17 -O2 -pthread test_pool.cpp malloc_4.cpp -o test_pool
+
+#define THREADS 4
+#define N 200
+
+struct Node {
+    long values[3];
+};
+
+typedef ObjectPool<Node, 16, true> CachedPool;
+
+size_t liveBlocks() {
+    return _num_allocated_blocks() - _num_free_blocks();
+}
+
+// the chunks go back to the heap with the pool
+void testChunksReturned() {
+    size_t live = liveBlocks();
+    {
+        ObjectPool<Node, 16> pool;
+        vector<Node*> nodes;
+        for (int i = 0; i < N; i++) nodes.push_back(pool.construct());
+        assert(liveBlocks() == live + (N + 15) / 16);
+        for (Node* node : nodes) pool.destroy(node);
+        // freed slots are reused, no chunk is added
+        for (int i = 0; i < N; i++) nodes[i] = pool.construct();
+        assert(liveBlocks() == live + (N + 15) / 16);
+        for (Node* node : nodes) pool.destroy(node);
+    }
+    assert(liveBlocks() == live);
+    cout << "chunks returned: ok" << endl;
+}
+
+// two pools of one type in one thread each keep their own cache
+void testTwoPoolsOneThread() {
+    size_t live = liveBlocks();
+    {
+        CachedPool a, b;
+        vector<Node*> from_a, from_b;
+        for (int i = 0; i < N; i++) {
+            from_a.push_back(a.construct());
+            from_b.push_back(b.construct());
+        }
+        for (Node* node : from_a) a.destroy(node);
+        for (Node* node : from_b) b.destroy(node);
+
+        // b's slots are never handed out by a
+        for (int i = 0; i < N; i++) {
+            Node* node = a.construct();
+            for (Node* other : from_b) assert(node != other);
+            a.destroy(node);
+        }
+    }
+    assert(liveBlocks() == live);
+    cout << "two pools in one thread: ok" << endl;
+}
+
+// a pool destroyed while other threads still cache its slots, they exit afterwards
+void testPoolDestroyedFirst() {
+    atomic<int> phase(0);
+    CachedPool* pool = new CachedPool();
+    CachedPool kept;
+
+    vector<thread> threads;
+    for (int t = 0; t < THREADS; t++) threads.emplace_back([&] {
+        vector<Node*> nodes;
+        for (int i = 0; i < N / 2; i++) nodes.push_back(pool->construct());
+        for (Node* node : nodes) pool->destroy(node);
+        phase++;
+        while (phase.load() <= THREADS) usleep(1000);
+
+        // the destroyed pool's cache entry is taken by another pool
+        CachedPool other;
+        for (int i = 0; i < N / 2; i++) {
+            Node* node = other.construct();
+            node->values[0] = i;
+            other.destroy(node);
+        }
+        for (int i = 0; i < N / 2; i++) kept.destroy(kept.construct());
+    });
+
+    while (phase.load() < THREADS) usleep(1000);
+    delete pool;
+    phase++;
+    for (auto& t : threads) t.join();
+    cout << "pool destroyed before its threads: ok" << endl;
+}
+
+int main() {
+    testChunksReturned();
+    testTwoPoolsOneThread();
+    testPoolDestroyedFirst();
+    return 0;
+}
@@ -0,0 +1,97 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <assert.h>
+#include <string.h>
+#include <sys/resource.h>
+#include "malloc_4.h"
+using namespace std;
+
+// build: g++ -std=c++17 -O2 test_realloc.cpp malloc_4.cpp -o test_realloc
+
+#define MAX_ALLOC 100000000
+
+// a reservation is bounded by its own range, not by smalloc's limit
+void testLargeReservation() {
+    size_t blocks = _num_allocated_blocks(), bytes = _num_allocated_bytes();
+    size_t reserved = (size_t)8 << 30;
+    char* p = (char*)sreserve(reserved);
+    assert(p && (size_t)p % 4096 == 0 && susable_size(p) == 0);
+    assert(sgrow(p, 4096));
+    memset(p, 1, 4096);
+
+    size_t big = (size_t)300 << 20;
+    assert(big > MAX_ALLOC);
+    SReallocStats before = srealloc_stats();
+    assert(srealloc(p, big) == p);
+    assert(susable_size(p) >= big);
+    p[big - 1] = 2;
+    assert(p[0] == 1);
+    assert(srealloc_stats().copied_bytes == before.copied_bytes); // grown in place
+
+    // shrinks in place, the pages after it are given back
+    assert(srealloc(p, 8192) == p && susable_size(p) == 8192);
+
+    // past the reservation it fails and the buffer is untouched
+    assert(!srealloc(p, reserved + 1));
+    assert(susable_size(p) == 8192 && p[0] == 1);
+    assert(!sgrow(p, reserved + 1));
+
+    // only what is committed counts
+    assert(srealloc(p, 200 << 20) == p);
+    assert(_num_allocated_bytes() == bytes + ((size_t)200 << 20));
+    sfree(p);
+    assert(_num_allocated_bytes() == bytes && _num_allocated_blocks() == blocks);
+    cout << "srealloc on a large reservation: ok" << endl;
+}
+
+// bytes of private writable mappings, what RLIMIT_DATA bounds
+size_t dataBytes() {
+    ifstream status("/proc/self/status");
+    string line;
+    while (getline(status, line))
+        if (line.rfind("VmData:", 0) == 0) return stoul(line.substr(7)) * 1024;
+    return 0;
+}
+
+// a block followed by the free wilderness, when neither sbrk nor relocation can get memory
+void testWildernessWithoutMemory() {
+    char* p = (char*)smalloc(1000);
+    char* wilderness = (char*)smalloc(5000);
+    memset(p, 7, 1000);
+    sfree(wilderness);
+
+    size_t size = susable_size(p);
+    size_t free_blocks = _num_free_blocks(), free_bytes = _num_free_bytes();
+    size_t bytes = _num_allocated_bytes();
+    SReallocStats before = srealloc_stats();
+
+    struct rlimit limit;
+    getrlimit(RLIMIT_DATA, &limit);
+    struct rlimit no_growth = {dataBytes(), limit.rlim_max};
+    assert(setrlimit(RLIMIT_DATA, &no_growth) == 0);
+    char* q = (char*)srealloc(p, 20000);
+    setrlimit(RLIMIT_DATA, &limit);
+
+    // the free wilderness wasn't merged into it
+    assert(!q);
+    assert(susable_size(p) == size);
+    assert(_num_free_blocks() == free_blocks && _num_free_bytes() == free_bytes);
+    assert(_num_allocated_bytes() == bytes);
+    assert(srealloc_stats().merge_next_wilderness == before.merge_next_wilderness);
+    for (int i = 0; i < 1000; i++) assert(p[i] == 7);
+
+    // with memory it grows in place
+    q = (char*)srealloc(p, 20000);
+    assert(q == p && susable_size(q) >= 20000);
+    assert(srealloc_stats().merge_next_wilderness == before.merge_next_wilderness + 1);
+    assert(srealloc_stats().copied_bytes == before.copied_bytes);
+    sfree(q);
+    cout << "wilderness without memory: ok" << endl;
+}
+
+int main() {
+    testWildernessWithoutMemory(); // first, no free block it could relocate to
+    testLargeReservation();
+    return 0;
+}
@@ -0,0 +1,114 @@
+#include <iostream>
+#include <assert.h>
+#include <thread>
+#include <vector>
+#include "malloc_4.h"
+using namespace std;
+
+// build: g++ -std=c++17 -O2 -pthread test_tags.cpp malloc_4.cpp -o test_tags
+
+#define PARSER 1
+#define CACHE 2
+#define NET 3
+
+size_t usableSum(const vector<void*>& blocks) {
+    size_t sum = 0;
+    for (void* p : blocks) sum += susable_size(p);
+    return sum;
+}
+
+// every allocation path charges the thread's tag, srealloc keeps the block's tag
+// and another thread's sfree takes it off the tag it was charged to
+void testCharging() {
+    vector<void*> blocks;
+    {
+        STagScope scope(PARSER);
+        assert(stag_current() == PARSER);
+        for (int i = 0; i < 100; i++) blocks.push_back(smalloc(100));
+        blocks.push_back(smalloc(200000)); // mmap'ed
+        blocks.push_back(smalloc_aligned(4096, 5000));
+        blocks.push_back(scalloc(10, 10));
+    }
+    assert(stag_current() == STAG_NONE);
+
+    STagStats parser = stag_stats(PARSER);
+    assert(parser.live_blocks == 103 && parser.allocations == 103);
+    assert(parser.live_bytes == usableSum(blocks));
+
+    {
+        STagScope scope(CACHE);
+        for (int i = 0; i < 100; i += 2) blocks[i] = srealloc(blocks[i], 3000);
+        blocks[100] = srealloc(blocks[100], 10);
+
+        void* reserved = sreserve(1 << 20);
+        assert(sgrow(reserved, 10000));
+        blocks.push_back(reserved);
+        shandle_free(shandle_alloc(64));
+        SArena* arena = sarena_create(0);
+        sarena_alloc(arena, 100);
+        sarena_destroy(arena);
+    }
+
+    parser = stag_stats(PARSER);
+    STagStats cache = stag_stats(CACHE);
+    assert(parser.live_blocks == 103 && parser.live_bytes == usableSum(vector<void*>(blocks.begin(), blocks.begin() + 103)));
+    assert(cache.live_blocks == 1 && cache.live_bytes == 12288); // the reservation's committed pages
+    assert(cache.allocations == 4 && cache.frees == 3);
+
+    thread other([&] {
+        STagScope scope(NET);
+        for (void* p : blocks) sfree(p);
+    });
+    other.join();
+
+    parser = stag_stats(PARSER);
+    cache = stag_stats(CACHE);
+    assert(parser.live_blocks == 0 && parser.live_bytes == 0 && parser.frees == 103);
+    assert(cache.live_blocks == 0 && cache.live_bytes == 0);
+    assert(stag_stats(NET).allocations == 0 && stag_stats(NET).frees == 0);
+    cout << "charging: ok" << endl;
+}
+
+void testLargeTag() {
+    assert(stag_set(STAG_MAX + 1) == STAG_NONE);
+    STagStats before = stag_stats(STAG_NONE);
+    void* p = smalloc(100);
+    assert(stag_stats(STAG_NONE).live_blocks == before.live_blocks + 1);
+    sfree(p);
+    stag_set(STAG_NONE);
+    assert(stag_current() == STAG_NONE);
+    cout << "tags over STAG_MAX: ok" << endl;
+}
+
+// queued frees stay charged until they're drained
+void testDeferred() {
+    STagScope scope(PARSER);
+    vector<void*> blocks;
+    for (int i = 0; i < 1000; i++) blocks.push_back(smalloc(64 + i % 200));
+    blocks.push_back(smalloc(300000));
+    blocks.push_back(sreserve(1 << 20));
+    size_t live = _num_allocated_blocks() - _num_free_blocks();
+
+    for (void* p : blocks) sfree_deferred(p);
+    SDeferredStats queued = sfree_deferred_stats();
+    assert(queued.queued_blocks == 1001); // the empty reservation is freed at once
+    assert(_num_allocated_blocks() - _num_free_blocks() == live - 1);
+    assert(stag_stats(PARSER).live_blocks == 1001);
+
+    assert(sfree_drain(10) == 10);
+    assert(sfree_deferred_stats().queued_blocks == 991);
+    assert(sfree_drain(0) == 991);
+
+    SDeferredStats drained = sfree_deferred_stats();
+    assert(drained.queued_blocks == 0 && drained.queued_bytes == 0);
+    assert(drained.drained_blocks == queued.drained_blocks + 1001);
+    assert(stag_stats(PARSER).live_blocks == 0 && stag_stats(PARSER).live_bytes == 0);
+    cout << "deferred frees: ok" << endl;
+}
+
+int main() {
+    testCharging();
+    testLargeTag();
+    testDeferred();
+    return 0;
+}
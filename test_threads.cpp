@@ -0,0 +1,160 @@
+#include <iostream>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <atomic>
+#include <set>
+#include <thread>
+#include <vector>
+#include "malloc_4.h"
+using namespace std;
+
+// build: g++ -std=c++17 -O2 -pthread test_threads.cpp malloc_4.cpp malloc_4_mt.cpp -o test_threads
+// run:   GLIBC_TUNABLES=glibc.pthread.rseq=0 ./test_threads to test the thread caches,
+//        with rseq small sizes come from per-cpu caches
+// with -fsanitize=thread the per-cpu handoffs are annotated, so rseq may stay on
+
+#define N 200
+#define FREEING_THREADS 4
+
+vector<char*> objs;
+
+void* allocateAndExit(void*) {
+    for (int i = 0; i < N; i++) {
+        char* p = (char*)smalloc_mt(48);
+        memset(p, i, 48);
+        objs.push_back(p);
+    }
+    return nullptr;
+}
+
+// several threads free one owner's objects at once: they queue on its remote list
+// and the owner picks them up on its next smalloc_mt
+void testRemoteFrees() {
+    atomic<int> phase(0);
+    set<char*> freed;
+
+    thread owner([&] {
+        vector<char*> mine;
+        for (int i = 0; i < FREEING_THREADS * N; i++) {
+            char* p = (char*)smalloc_mt(64);
+            memset(p, i, 64);
+            mine.push_back(p);
+        }
+        objs = mine;
+        phase = 1;
+        while (phase.load() < 2) usleep(1000);
+
+        size_t reused = 0;
+        vector<char*> again;
+        for (int i = 0; i < FREEING_THREADS * N; i++) {
+            char* p = (char*)smalloc_mt(64);
+            reused += freed.count(p);
+            again.push_back(p);
+        }
+        assert(reused > 0);
+        for (char* p : again) sfree_mt(p);
+    });
+
+    while (phase.load() < 1) usleep(1000);
+    for (char* p : objs) freed.insert(p);
+
+    vector<thread> freeing;
+    for (int t = 0; t < FREEING_THREADS; t++) freeing.emplace_back([t] {
+        for (int i = t * N; i < (t + 1) * N; i++) {
+            for (int j = 0; j < 64; j++) assert(objs[i][j] == (char)i);
+            sfree_mt(objs[i]);
+        }
+    });
+    for (auto& t : freeing) t.join();
+    phase = 2;
+    owner.join();
+    objs.clear();
+    cout << "remote frees from several threads: ok" << endl;
+}
+
+// the exited thread's objects are freed by another thread: they reach its orphaned cache
+void testRemoteFreeToOrphan() {
+    pthread_t t;
+    pthread_create(&t, nullptr, allocateAndExit, nullptr);
+    pthread_join(t, nullptr);
+
+    set<char*> freed;
+    for (int i = 0; i < N; i++) {
+        for (int j = 0; j < 48; j++) assert(objs[i][j] == (char)i);
+        sfree_mt(objs[i]);
+        freed.insert(objs[i]);
+    }
+    objs.clear();
+
+    // a new thread adopts the cache and gets the freed objects back
+    pthread_create(&t, nullptr, [](void* arg) -> void* {
+        auto freed = (set<char*>*)arg;
+        size_t reused = 0;
+        vector<void*> mine;
+        for (int i = 0; i < N; i++) {
+            char* p = (char*)smalloc_mt(48);
+            reused += freed->count(p);
+            mine.push_back(p);
+        }
+        assert(reused > 0);
+        for (void* p : mine) sfree_mt(p);
+        return nullptr;
+    }, &freed);
+    pthread_join(t, nullptr);
+    cout << "remote free to an orphan: ok" << endl;
+}
+
+atomic<bool> adopted(false), remote_freed(false);
+
+void* adoptAndDrain(void*) {
+    char* own = (char*)smalloc_mt(256); // another class than the adopted objects
+    adopted = true;
+    while (!remote_freed) usleep(1000);
+
+    // the queued remote frees are picked up on the next smalloc_mt
+    for (int i = 0; i < 100; i++) sfree_mt(smalloc_mt(256));
+    char* again = (char*)smalloc_mt(48);
+    assert(again);
+    memset(again, 1, 48);
+    sfree_mt(again);
+    sfree_mt(own);
+    return nullptr;
+}
+
+// the cache of an exited thread is flushed by the scavenger, adopted by a new thread,
+// and receives remote frees while that thread uses it
+void testAdoptionWithRemoteFrees() {
+    pthread_t t;
+    pthread_create(&t, nullptr, allocateAndExit, nullptr);
+    pthread_join(t, nullptr);
+
+    size_t scavenged = _num_scavenged_objects();
+    SScavengerConfig config = {10, 0, 64};
+    assert(sscavenger_start(&config));
+    assert(!sscavenger_start(&config));
+    usleep(100000);
+    sscavenger_stop();
+    // the thread cached a batch beyond its objects
+    if (!smalloc_percpu_enabled()) assert(_num_scavenged_objects() > scavenged);
+
+    pthread_create(&t, nullptr, adoptAndDrain, nullptr);
+    while (!adopted) usleep(1000);
+    for (int i = 0; i < N; i++) {
+        for (int j = 0; j < 48; j++) assert(objs[i][j] == (char)i);
+        sfree_mt(objs[i]);
+    }
+    objs.clear();
+    remote_freed = true;
+    pthread_join(t, nullptr);
+    cout << "adoption with remote frees: ok" << endl;
+}
+
+int main() {
+    cout << (smalloc_percpu_enabled() ? "per-cpu caches" : "thread caches") << endl;
+    testRemoteFrees();
+    testRemoteFreeToOrphan();
+    testAdoptionWithRemoteFrees();
+    return 0;
+}
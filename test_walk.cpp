@@ -0,0 +1,109 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "malloc_4.h"
+using namespace std;
+
+// build: g++ -std=c++17 -O2 test_walk.cpp malloc_4.cpp -o test_walk
+
+#define SLOTS 256
+#define ROUNDS 5000
+#define STEP 7
+
+void churn(vector<char*>& slots, int rounds) {
+    for (int i = 0; i < rounds; i++) {
+        int k = rand() % SLOTS;
+        // mostly small, some mmap'ed
+        size_t size = rand() % 32 == 0 ? 150000 + rand() % 100000 : 16 + rand() % 3000;
+        if (!slots[k]) slots[k] = (char*)smalloc_hint(size, (SLifetime)(rand() % 3));
+        else if (rand() % 2) slots[k] = (char*)srealloc(slots[k], size);
+        else {
+            sfree(slots[k]);
+            slots[k] = nullptr;
+        }
+    }
+}
+
+void checkSnapshot(const SHeapSnapshot& snapshot) {
+    assert(snapshot.complete);
+    assert(snapshot.free_blocks == _num_free_blocks() && snapshot.free_bytes == _num_free_bytes());
+    assert(snapshot.used_blocks + snapshot.free_blocks == _num_allocated_blocks());
+    assert(snapshot.used_bytes + snapshot.free_bytes == _num_allocated_bytes());
+
+    size_t used = 0, free = 0;
+    for (int i = 0; i < SHEAP_SIZE_BUCKETS; i++) {
+        used += snapshot.used_sizes[i];
+        free += snapshot.free_sizes[i];
+    }
+    assert(used == snapshot.used_blocks && free == snapshot.free_blocks);
+    assert(snapshot.largest_free <= snapshot.free_bytes && snapshot.fragmentation <= 100);
+}
+
+// the counts of a walk, one lock hold per STEP blocks, match the heap's own
+void testWalkCounts() {
+    vector<char*> slots(SLOTS, nullptr);
+    for (unsigned seed = 1; seed <= 8; seed++) {
+        srand(seed);
+        churn(slots, ROUNDS);
+        checkSnapshot(sheap_snapshot(STEP));
+
+        // the heap changes between steps: the walk resumes and still ends
+        SHeapSnapshot snapshot;
+        sheap_snapshot_begin(&snapshot);
+        while (!sheap_snapshot_step(&snapshot, STEP)) churn(slots, 3);
+    }
+
+    for (char*& p : slots) sfree(p);
+    checkSnapshot(sheap_snapshot(STEP));
+    cout << "walk counts: ok" << endl;
+}
+
+// the map file holds a record per block of the walk
+void testMapRoundTrip() {
+    vector<char*> slots(SLOTS, nullptr);
+    srand(9);
+    churn(slots, ROUNDS);
+
+    string path = "/tmp/test_walk_" + to_string(getpid()) + ".map";
+    assert(sheap_write_map(path.c_str(), STEP));
+    SHeapSnapshot snapshot = sheap_snapshot(STEP);
+    checkSnapshot(snapshot);
+
+    FILE* file = fopen(path.c_str(), "rb");
+    assert(file);
+    SHeapMapHeader header;
+    assert(fread(&header, sizeof(header), 1, file) == 1);
+    assert(header.magic == SHEAP_MAP_MAGIC && header.meta_data_size == _size_meta_data());
+    assert(header.blocks == snapshot.used_blocks + snapshot.free_blocks);
+
+    size_t free_blocks = 0, free_bytes = 0, bytes = 0, mmap_blocks = 0;
+    SHeapMapRecord record;
+    for (size_t i = 0; i < header.blocks; i++) {
+        assert(fread(&record, sizeof(record), 1, file) == 1);
+        size_t size = record.size_flags & ~(size_t)7;
+        bytes += size;
+        if (record.size_flags & SHEAP_MAP_FREE) {
+            free_blocks++;
+            free_bytes += size;
+        }
+        if (((record.size_flags >> SHEAP_MAP_PART_SHIFT) & 3) == 3) mmap_blocks++;
+    }
+    assert(fread(&record, sizeof(record), 1, file) == 0); // nothing after the last record
+    fclose(file);
+    unlink(path.c_str());
+
+    assert(free_blocks == snapshot.free_blocks && free_bytes == snapshot.free_bytes);
+    assert(bytes == _num_allocated_bytes() && mmap_blocks == snapshot.mmap_blocks && mmap_blocks > 0);
+
+    for (char* p : slots) sfree(p);
+    cout << "heap map round trip: ok" << endl;
+}
+
+int main() {
+    testWalkCounts();
+    testMapRoundTrip();
+    return 0;
+}